@@ -0,0 +1,164 @@
+/*
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//
+// Archives the timestamps of a gpiots device to a file or pipe without copying them through userspace.
+//
+// The records are moved with splice(): from the device into a pipe, and from the pipe into the output
+// file. When the output is a pipe already (e.g. gpiots_archive /dev/gpiotsall - | gzip > archive.gz)
+// they are spliced from the device straight into it.
+//
+// The record size must match what the device delivers: timespec64 structs by default, or
+// struct gpio_ts_event records (-r) for the merged device, with records=1 or in pulse width mode.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../gpiots_event.h"
+
+typedef int64_t time64_t;
+struct timespec64 {
+	time64_t	tv_sec;			/* seconds */
+	long		tv_nsec;		/* nanoseconds */
+};
+
+#define RECORDS_PER_SPLICE 1024
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig) {
+    running = 0;
+}
+
+// move exactly n bytes from the pipe into the output
+static int drain_pipe(int pipe_rd, int out, size_t n) {
+    while (n > 0) {
+        ssize_t rc = splice(pipe_rd, NULL, out, NULL, n, SPLICE_F_MOVE);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        n -= rc;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+
+    bool records = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r")) != -1) {
+        switch (opt) {
+        case 'r':
+            records = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r] device output|-\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-r] device output|-\n", argv[0]);
+        exit(1);
+    }
+    const char *device = argv[optind];
+    const char *output = argv[optind + 1];
+    size_t recsize = records ? sizeof(struct gpio_ts_event) : sizeof(struct timespec64);
+    size_t chunk = recsize * RECORDS_PER_SPLICE;
+
+    int fd = open(device, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s open error %d\n", device, fd);
+        exit(-1);
+    }
+    // splice() refuses O_APPEND files, so append by seeking to the end instead
+    int out = (strcmp(output, "-") == 0) ? STDOUT_FILENO : open(output, O_WRONLY | O_CREAT, 0644);
+    if (out < 0) {
+        perror(output);
+        exit(-1);
+    }
+    lseek(out, 0, SEEK_END);
+
+    // splice needs a pipe on one side: use the output if it is one, otherwise one of our own
+    struct stat st;
+    fstat(out, &st);
+    bool direct = S_ISFIFO(st.st_mode);
+    int pipefd[2] = { -1, -1 };
+    if (!direct) {
+        if (pipe(pipefd) != 0) {
+            perror("pipe");
+            exit(-1);
+        }
+        fcntl(pipefd[1], F_SETPIPE_SZ, (int)chunk);
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    struct pollfd pfd = { .fd = fd, .events = POLLPRI | POLLERR };
+    uint64_t total = 0;
+    while (running) {
+        // the device never blocks, a zero return means it is drained
+        ssize_t n = splice(fd, NULL, direct ? out : pipefd[1], NULL, chunk, SPLICE_F_MOVE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("splice from device failed");
+            break;
+        }
+        if (n == 0) {
+            if ((poll(&pfd, 1, 2000) < 0) && (errno != EINTR)) {
+                perror("poll failed");
+                break;
+            }
+            continue;
+        }
+        if (!direct && (drain_pipe(pipefd[0], out, n) != 0)) {
+            perror("splice to output failed");
+            break;
+        }
+        total += n;
+    }
+
+    fprintf(stderr, "%lu records archived\n", (unsigned long)(total / recsize));
+    close(fd);
+    if (out != STDOUT_FILENO) {
+        close(out);
+    }
+    exit(0);
+}
@@ -0,0 +1,138 @@
+/*
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//
+// Arms a triggered capture on the gpiotscapture device, waits for it to complete and prints it.
+//
+// The captured edges are printed as "index,sec,nsec" lines, like gpiots_client does, followed by
+// "trigger", "falling" or "polled" where that applies, so the output can be fed to gpiots_analyze.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "../gpiots_ioctl.h"
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s -t trigger [-e rising|falling|both] -g gpio[,gpio...] [-b before] [-a after] [-d device]\n", name);
+    fprintf(stderr, "  -t  index of the gpiots device that triggers the capture\n");
+    fprintf(stderr, "  -e  trigger edge, default rising\n");
+    fprintf(stderr, "  -g  indexes of the gpiots devices whose edges are captured\n");
+    fprintf(stderr, "  -b  number of edges to keep from before the trigger, default 0\n");
+    fprintf(stderr, "  -a  number of edges to capture after the trigger, default 1000\n");
+    fprintf(stderr, "  -d  capture device, default /dev/gpiotscapture\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+
+    const char *device = "/dev/gpiotscapture";
+    struct gpio_ts_capture config = { .trigger = UINT32_MAX, .edge = GPIO_TS_CAPTURE_RISING, .post = 1000 };
+    char *list;
+    char *tok;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:e:g:b:a:d:")) != -1) {
+        switch (opt) {
+        case 't':
+            config.trigger = atoi(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "rising") == 0) {
+                config.edge = GPIO_TS_CAPTURE_RISING;
+            } else if (strcmp(optarg, "falling") == 0) {
+                config.edge = GPIO_TS_CAPTURE_FALLING;
+            } else if (strcmp(optarg, "both") == 0) {
+                config.edge = GPIO_TS_CAPTURE_BOTH;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'g':
+            list = optarg;
+            while ((tok = strsep(&list, ",")) != NULL) {
+                config.targets |= 1u << atoi(tok);
+            }
+            break;
+        case 'b':
+            config.pre = atoi(optarg);
+            break;
+        case 'a':
+            config.post = atoi(optarg);
+            break;
+        case 'd':
+            device = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ((config.trigger == UINT32_MAX) || (config.targets == 0)) {
+        usage(argv[0]);
+    }
+
+    int fd = open(device, O_RDONLY);
+    if (fd < 0) {
+        perror(device);
+        exit(-1);
+    }
+    if (ioctl(fd, GPIO_TS_IOC_CAPTURE_ARM, &config) != 0) {
+        perror("arming the capture failed");
+        exit(-1);
+    }
+    fprintf(stderr, "armed, waiting for the trigger\n");
+
+    size_t nevents = config.pre + 1 + config.post;
+    struct gpio_ts_event *events = malloc(nevents * sizeof(struct gpio_ts_event));
+    if (events == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(-1);
+    }
+    // blocks until the capture is complete
+    ssize_t lg = read(fd, events, nevents * sizeof(struct gpio_ts_event));
+    if (lg < 0) {
+        perror("reading the capture failed");
+        exit(-1);
+    }
+
+    size_t n = lg / sizeof(struct gpio_ts_event);
+    for (size_t i = 0; i < n; i++) {
+        struct gpio_ts_event *e = &events[i];
+        printf("%u,%lld,%09lld%s%s%s\n", e->index, (long long)e->tv_sec, (long long)e->tv_nsec,
+               (e->flags & GPIO_TS_EVENT_TRIGGER) ? " trigger" : "",
+               (e->flags & GPIO_TS_EVENT_FALLING) ? " falling" : "",
+               (e->flags & GPIO_TS_EVENT_POLLED) ? " polled" : "");
+    }
+    fprintf(stderr, "%lu edges captured\n", (unsigned long)n);
+
+    free(events);
+    close(fd);
+    exit(0);
+}
@@ -0,0 +1,243 @@
+/*
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//
+// Low-latency consumer of one gpiots device.
+//
+// Pins itself to a (preferably isolated) CPU, runs with SCHED_FIFO priority and locks its memory,
+// then waits for timestamps in one of three ways:
+//   spin:     calls the non-blocking read() in a tight loop
+//   sleep:    sleeps in poll() until the ISR wakes it up, like gpiots_client
+//   adaptive: spins for a while after each timestamp, as the next one is likely to follow soon,
+//             and falls back to sleeping in poll() when the input goes quiet
+// For every timestamp it measures the latency from the interrupt (the ISR timestamp) to the moment
+// the timestamp is available in userspace, and prints a latency histogram when done.
+//
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef int64_t time64_t;
+struct timespec64 {
+	time64_t	tv_sec;			/* seconds */
+	long		tv_nsec;		/* nanoseconds */
+};
+
+#define HIST_BUCKETS 1000   // 1 us buckets, the last one counts everything beyond
+
+enum mode { MODE_SPIN, MODE_SLEEP, MODE_ADAPTIVE };
+
+static volatile sig_atomic_t running = 1;
+static uint64_t histogram[HIST_BUCKETS + 1];
+static uint64_t nsamples;
+static int64_t min_ns = INT64_MAX, max_ns, sum_ns;
+
+static void stop(int sig) {
+    running = 0;
+}
+
+static int64_t now_ns(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void record(const struct timespec64 *ts, int64_t now) {
+    int64_t lat = now - ((int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec);
+    int64_t b = lat / 1000;
+    histogram[(b < 0) ? 0 : (b < HIST_BUCKETS ? b : HIST_BUCKETS)]++;
+    nsamples++;
+    sum_ns += lat;
+    if (lat < min_ns) {
+        min_ns = lat;
+    }
+    if (lat > max_ns) {
+        max_ns = lat;
+    }
+}
+
+static int64_t percentile(double p) {
+    uint64_t target = (uint64_t)(p * nsamples);
+    uint64_t seen = 0;
+    for (int b = 0; b <= HIST_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen > target) {
+            return b;
+        }
+    }
+    return HIST_BUCKETS;
+}
+
+static void report(const char *mode) {
+    if (nsamples == 0) {
+        fprintf(stderr, "no timestamps received\n");
+        return;
+    }
+    printf("mode %s: %" PRIu64 " timestamps, edge to userspace latency: min %.1f us, avg %.1f us, max %.1f us, "
+           "p50 %" PRId64 " us, p99 %" PRId64 " us, p99.9 %" PRId64 " us\n",
+           mode, nsamples, min_ns / 1e3, (double)sum_ns / nsamples / 1e3, max_ns / 1e3, percentile(0.5), percentile(0.99),
+           percentile(0.999));
+    printf("latency_us,count\n");
+    for (int b = 0; b <= HIST_BUCKETS; b++) {
+        if (histogram[b] != 0) {
+            printf("%s%d,%" PRIu64 "\n", b == HIST_BUCKETS ? ">=" : "", b, histogram[b]);
+        }
+    }
+}
+
+static void setup_realtime(int cpu, int prio) {
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            perror("sched_setaffinity");
+        }
+    }
+    if (prio > 0) {
+        struct sched_param sp = { .sched_priority = prio };
+        if (sched_setscheduler(0, SCHED_FIFO, &sp) != 0) {
+            perror("sched_setscheduler (needs root or CAP_SYS_NICE)");
+        }
+    }
+    // no page faults once we're running
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        perror("mlockall");
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-d device] [-m spin|sleep|adaptive] [-c cpu] [-p priority] [-s spin_us] [-n count] [-S]\n", prog);
+    fprintf(stderr, "  -S  the module was loaded with safemode=1\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+
+    const char *device = "/dev/gpiots0";
+    const char *modename = "adaptive";
+    enum mode mode = MODE_ADAPTIVE;
+    int cpu = -1;
+    int prio = 80;
+    int64_t spin_ns = 1000000;  // adaptive: keep spinning for 1 ms after a timestamp
+    uint64_t count = 0;         // 0 means until interrupted
+    bool safemode = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:m:c:p:s:n:S")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'm':
+            modename = optarg;
+            if (strcmp(optarg, "spin") == 0) {
+                mode = MODE_SPIN;
+            } else if (strcmp(optarg, "sleep") == 0) {
+                mode = MODE_SLEEP;
+            } else if (strcmp(optarg, "adaptive") == 0) {
+                mode = MODE_ADAPTIVE;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 'p':
+            prio = atoi(optarg);
+            break;
+        case 's':
+            spin_ns = atoll(optarg) * 1000;
+            break;
+        case 'n':
+            count = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            safemode = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    int fd = open(device, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s open error %d\n", device, fd);
+        exit(-1);
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    setup_realtime(cpu, prio);
+
+    struct pollfd pfd = { .fd = fd, .events = POLLPRI | POLLERR };
+    struct timespec64 ts[64];
+    size_t length = safemode ? sizeof(ts) : 64;
+    int64_t last_event = 0;
+
+    while (running && ((count == 0) || (nsamples < count))) {
+        // read() never blocks: it returns 0 when there's nothing yet
+        ssize_t n = read(fd, ts, length);
+        if (n < 0) {
+            perror("read failed");
+            break;
+        }
+        if (safemode) {
+            n /= sizeof(struct timespec64);
+        }
+        if (n > 0) {
+            int64_t now = now_ns(CLOCK_REALTIME);
+            for (int i = 0; i < n; i++) {
+                record(&ts[i], now);
+            }
+            last_event = now_ns(CLOCK_MONOTONIC);
+            continue;
+        }
+        if ((mode == MODE_SPIN) || ((mode == MODE_ADAPTIVE) && (now_ns(CLOCK_MONOTONIC) - last_event < spin_ns))) {
+            continue;
+        }
+        // quiet: sleep until the ISR wakes us up
+        if ((poll(&pfd, 1, 500) < 0) && running) {
+            perror("poll failed");
+            break;
+        }
+    }
+
+    report(modename);
+    close(fd);
+    exit(0);
+}
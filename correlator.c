@@ -0,0 +1,193 @@
+#include "correlator.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NSEC_PER_SEC 1000000000LL
+
+static int64_t to_ns(const struct timespec64 *ts) {
+    return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static struct timespec64 to_timespec(int64_t ns) {
+    return (struct timespec64){ ns / NSEC_PER_SEC, ns % NSEC_PER_SEC };
+}
+
+static bool ring_init(correlator_ring_t *r, unsigned int size) {
+    r->data = (correlator_event_t *)malloc(size * sizeof(correlator_event_t));
+    r->head = 0;
+    r->count = 0;
+    r->size = size;
+    return r->data != NULL;
+}
+
+static correlator_event_t *ring_at(correlator_ring_t *r, unsigned int i) {
+    return &r->data[(r->head + i) % r->size];
+}
+
+static void ring_pop(correlator_ring_t *r) {
+    r->head = (r->head + 1) % r->size;
+    r->count--;
+}
+
+static void ring_push(correlator_ring_t *r, const correlator_event_t *e) {
+    *ring_at(r, r->count) = *e;
+    r->count++;
+}
+
+// insert keeping the ring ordered by timestamp
+// late events are rare and only a few places late, so the search from the back is short
+static void ring_insert(correlator_ring_t *r, const correlator_event_t *e) {
+    unsigned int i = r->count;
+    while ((i > 0) && (ring_at(r, i - 1)->ts > e->ts)) {
+        *ring_at(r, i) = *ring_at(r, i - 1);
+        i--;
+    }
+    *ring_at(r, i) = *e;
+    r->count++;
+}
+
+static void emit(correlator_t *c, int lane, int64_t start, int64_t end) {
+    fifo_payload_t result = { .lusid = lane };
+    if (start != 0) {
+        result.ts_start = to_timespec(start);
+    }
+    if (end != 0) {
+        result.ts_end = to_timespec(end);
+    }
+    c->emit(c->ctx, &result);
+}
+
+// report the waiting start of a lane as lost if its end can no longer arrive in time
+static void expire(correlator_t *c, correlator_lane_t *l, int lane, int64_t limit) {
+    if ((l->start != 0) && (limit - l->start > c->cfg.max_travel_ns)) {
+        emit(c, lane, l->start, 0);
+        c->stats.lost_starts++;
+        l->start = 0;
+    }
+}
+
+// match the events of a lane, in timestamp order, up to and including limit
+static void process_lane(correlator_t *c, int lane, int64_t limit) {
+    correlator_lane_t *l = &c->lanes[lane];
+    while ((l->pending.count > 0) && (ring_at(&l->pending, 0)->ts <= limit)) {
+        correlator_event_t e = *ring_at(&l->pending, 0);
+        ring_pop(&l->pending);
+        expire(c, l, lane, e.ts);
+        if (!e.is_end) {
+            if (l->start != 0) { // two starts in a row: the first one never got its end
+                emit(c, lane, l->start, 0);
+                c->stats.lost_starts++;
+            }
+            l->start = e.ts;
+            correlator_event_t x = { .ts = e.ts + c->cfg.max_travel_ns, .lane = lane };
+            if (c->expiry.count == c->expiry.size) { // out of room: the lane of the oldest entry expires on its next event
+                ring_pop(&c->expiry);
+            }
+            ring_push(&c->expiry, &x);
+        } else if ((l->start != 0) && (e.ts - l->start >= c->cfg.min_travel_ns)) {
+            emit(c, lane, l->start, e.ts);
+            c->stats.pairs++;
+            l->start = 0;
+        } else {
+            emit(c, lane, 0, e.ts);
+            c->stats.lost_ends++;
+        }
+    }
+}
+
+// move the watermark forward and match everything that is now old enough
+static void advance(correlator_t *c, int64_t watermark) {
+    if (watermark <= c->watermark) {
+        return;
+    }
+    c->watermark = watermark;
+    while ((c->work.count > 0) && (ring_at(&c->work, 0)->ts <= watermark)) {
+        int lane = ring_at(&c->work, 0)->lane;
+        ring_pop(&c->work);
+        process_lane(c, lane, watermark);
+    }
+    while ((c->expiry.count > 0) && (ring_at(&c->expiry, 0)->ts < watermark)) {
+        int lane = ring_at(&c->expiry, 0)->lane;
+        ring_pop(&c->expiry);
+        expire(c, &c->lanes[lane], lane, watermark);
+    }
+}
+
+correlator_t *correlator_create(const correlator_config_t *cfg, correlator_emit_t emit, void *ctx) {
+    correlator_t *c = (correlator_t *)calloc(1, sizeof(correlator_t));
+    if (c == NULL) {
+        fprintf(stderr, "correlator_create: out of memory\n");
+        return NULL;
+    }
+    c->cfg = *cfg;
+    c->emit = emit;
+    c->ctx = ctx;
+    c->lanes = (correlator_lane_t *)calloc(cfg->nlanes, sizeof(correlator_lane_t));
+    bool ok = (c->lanes != NULL);
+    for (int i = 0; ok && (i < cfg->nlanes); i++) {
+        ok = ring_init(&c->lanes[i].pending, cfg->depth);
+    }
+    ok = ok && ring_init(&c->work, cfg->nlanes * cfg->depth) && ring_init(&c->expiry, cfg->nlanes * cfg->depth);
+    if (!ok) {
+        fprintf(stderr, "correlator_create: out of memory\n");
+        correlator_destroy(c);
+        return NULL;
+    }
+    return c;
+}
+
+void correlator_destroy(correlator_t *c) {
+    if (c == NULL) {
+        return;
+    }
+    if (c->lanes != NULL) {
+        for (int i = 0; i < c->cfg.nlanes; i++) {
+            free(c->lanes[i].pending.data);
+        }
+        free(c->lanes);
+    }
+    free(c->work.data);
+    free(c->expiry.data);
+    free(c);
+}
+
+// add a start (is_end false) or end event of a lane
+void correlator_add(correlator_t *c, int lane, bool is_end, const struct timespec64 *ts) {
+    correlator_event_t e = { .ts = to_ns(ts), .lane = lane, .is_end = is_end };
+    correlator_lane_t *l = &c->lanes[lane];
+
+    if (e.ts <= c->watermark) {
+        c->stats.late++;
+    }
+    // out of room: the window is too large for the traffic, match the oldest events early
+    if (l->pending.count == l->pending.size) {
+        process_lane(c, lane, ring_at(&l->pending, 0)->ts);
+    }
+    if (c->work.count == c->work.size) {
+        advance(c, ring_at(&c->work, 0)->ts);
+    }
+    ring_insert(&l->pending, &e);
+    ring_push(&c->work, &e);
+    if (e.ts <= c->watermark) {
+        process_lane(c, lane, c->watermark);
+    }
+    if (e.ts > c->newest) {
+        c->newest = e.ts;
+        advance(c, c->newest - c->cfg.window_ns);
+    }
+}
+
+// let time pass without events, so waiting events get matched or expired
+void correlator_advance(correlator_t *c, const struct timespec64 *now) {
+    advance(c, to_ns(now) - c->cfg.window_ns);
+}
+
+// match everything that is still pending
+void correlator_flush(correlator_t *c) {
+    int64_t end = c->newest + c->cfg.max_travel_ns + 1;
+    advance(c, end);
+    for (int i = 0; i < c->cfg.nlanes; i++) {
+        process_lane(c, i, end);
+        expire(c, &c->lanes[i], i, end);
+    }
+}
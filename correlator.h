@@ -0,0 +1,75 @@
+#ifndef _CORRELATOR_H_
+#define _CORRELATOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "fifo_payload.h"
+
+// Matches the start and end events of many lanes (lussen) into pairs.
+//
+// Events may arrive out of order, as long as they are at most window_ns late: an event is
+// only matched once the newest timestamp seen is window_ns past it, so every event that
+// could precede it has arrived by then. Within a lane a start is paired with the first end
+// that follows it, if the travel time lies between min_travel_ns and max_travel_ns.
+// Starts without an end, ends without a start and starts whose end doesn't arrive within
+// max_travel_ns are reported as unmatched.
+//
+// Every event is inserted once in its lane and once in the global work ring and taken out
+// of each once, so the work per event is bounded by the window and not by the number of lanes.
+
+typedef struct CORRELATOR_CONFIG_T {
+    int nlanes;
+    int depth;              // maximum number of unmatched events per lane
+    int64_t window_ns;      // how late an event may arrive
+    int64_t min_travel_ns;  // shortest plausible start to end time
+    int64_t max_travel_ns;  // longest plausible start to end time, older starts are expired
+} correlator_config_t;
+
+// called for every result: a pair, or an unmatched event with the other timestamp zeroed
+typedef void (*correlator_emit_t)(void *ctx, const fifo_payload_t *result);
+
+typedef struct CORRELATOR_EVENT_T {
+    int64_t ts;
+    int lane;
+    bool is_end;
+} correlator_event_t;
+
+typedef struct CORRELATOR_RING_T {
+    correlator_event_t *data;
+    unsigned int head;
+    unsigned int count;
+    unsigned int size;
+} correlator_ring_t;
+
+typedef struct CORRELATOR_LANE_T {
+    correlator_ring_t pending;  // events not yet matched, ordered by timestamp
+    int64_t start;              // start waiting for its end, 0 if none
+} correlator_lane_t;
+
+typedef struct CORRELATOR_STATS_T {
+    uint64_t pairs;
+    uint64_t lost_starts;
+    uint64_t lost_ends;
+    uint64_t late;              // events that arrived more than window_ns late
+} correlator_stats_t;
+
+typedef struct CORRELATOR_T {
+    correlator_config_t cfg;
+    correlator_lane_t *lanes;
+    correlator_ring_t work;     // one entry per event, in arrival order
+    correlator_ring_t expiry;   // one entry per start, ordered by expiry time
+    int64_t newest;             // newest timestamp seen
+    int64_t watermark;          // everything up to here has been matched
+    correlator_emit_t emit;
+    void *ctx;
+    correlator_stats_t stats;
+} correlator_t;
+
+correlator_t *correlator_create(const correlator_config_t *cfg, correlator_emit_t emit, void *ctx);
+void correlator_destroy(correlator_t *c);
+
+void correlator_add(correlator_t *c, int lane, bool is_end, const struct timespec64 *ts);
+void correlator_advance(correlator_t *c, const struct timespec64 *now);
+void correlator_flush(correlator_t *c);
+
+#endif //_CORRELATOR_H_
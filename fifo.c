@@ -1,87 +1,176 @@
 #include "fifo.h"
+#include <linux/futex.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
-// This initializes the FIFO structure with the given buffer and size
+static void fifo_futex_wait(_Atomic uint32_t *addr, uint32_t val, int timeout_ms) {
+  struct timespec ts;
+  struct timespec *pts = NULL;
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    pts = &ts;
+  }
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, pts, NULL, 0);
+}
+
+static void fifo_futex_wake(_Atomic uint32_t *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// wake up the consumer if it is sleeping in fifo_read_wait()
+// the fence orders the release store of the payload before the load of waiting:
+// together with the fence in fifo_read_wait() either the consumer sees the payload or we see it waiting
+static void fifo_wake(fifo_t *f) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&f->waiting)) {
+    atomic_fetch_add(&f->futex, 1);
+    fifo_futex_wake(&f->futex);
+  }
+}
+
+// This initializes the FIFO structure with room for at least size payloads
 fifo_t *fifo_create(int size) {
-  fifo_t *f = (fifo_t *)malloc(sizeof(fifo_t));
+  uint32_t n = 2;
+  while (n < (uint32_t)size) {
+    n <<= 1;
+  }
+  fifo_t *f = (fifo_t *)aligned_alloc(FIFO_CACHELINE, sizeof(fifo_t));
   if (f == NULL) {
     fprintf(stderr, "fifo_create: out of memory\n");
     return NULL;
   }
-  f->head = 0;
-  f->tail = 0;
-  f->size = size + 1;
-  f->data = (fifo_payload_t *)malloc((size + 1) * sizeof(fifo_payload_t));
+  f->size = n;
+  f->mask = n - 1;
+  f->data = (fifo_slot_t *)malloc(n * sizeof(fifo_slot_t));
   if (f->data == NULL) {
     fprintf(stderr, "fifo_create: out of memory\n");
+    free(f);
     return NULL;
   }
+  for (uint32_t i = 0; i < n; i++) {
+    atomic_init(&f->data[i].seq, i); // slot i is free for the producer claiming position i
+  }
+  atomic_init(&f->head, 0);
+  atomic_init(&f->tail, 0);
+  atomic_init(&f->futex, 0);
+  atomic_init(&f->waiting, 0);
+  atomic_init(&f->closed, false);
   return f;
 }
 
 // release the fifo memory
 void fifo_destroy(fifo_t *f) {
-  if (f->data != NULL) {
-    free(f->data);
-  }
   if (f != NULL) {
+    free(f->data);
     free(f);
   }
 }
 
-// This reads ndata payloads from the FIFO
+// This reads up to ndata payloads from the FIFO without blocking
+// Only one thread may read from a FIFO
 // The number of payloads read is returned
 int fifo_read(fifo_t *f, fifo_payload_t *data, int ndata) {
   int i;
-  fifo_payload_t *p = data;
+  uint32_t pos = atomic_load_explicit(&f->tail, memory_order_relaxed);
   for (i = 0; i < ndata; i++) {
-    if (f->tail != f->head) {   // see if any data is available
-      *p++ = f->data[f->tail];  // grab a payload from the buffer
-      f->tail++;                // increment the tail
-      if (f->tail == f->size) { // check for wrap-around
-        f->tail = 0;
-      }
-    } else {
-      return i; // number of payloads read
+    fifo_slot_t *slot = &f->data[pos & f->mask];
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if ((int32_t)(seq - (pos + 1)) < 0) {
+      break; // no (completely written) payload available
     }
+    data[i] = slot->payload;
+    // hand the slot back to the producers for the next round
+    atomic_store_explicit(&slot->seq, pos + f->size, memory_order_release);
+    pos++;
   }
-  return ndata;
+  atomic_store_explicit(&f->tail, pos, memory_order_relaxed);
+  return i;
 }
 
-// This writes up to ndata payloads to the FIFO
+// Like fifo_read(), but sleeps until at least one payload is available,
+// the timeout (in milliseconds, -1 is forever) expires or the FIFO is closed
+int fifo_read_wait(fifo_t *f, fifo_payload_t *data, int ndata, int timeout_ms) {
+  int n = fifo_read(f, data, ndata);
+  if (n > 0) {
+    return n;
+  }
+  uint32_t val = atomic_load(&f->futex);
+  atomic_store(&f->waiting, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  // check again: a producer may have written before it could see that we are waiting
+  n = fifo_read(f, data, ndata);
+  if ((n == 0) && !fifo_closed(f)) {
+    fifo_futex_wait(&f->futex, val, timeout_ms);
+    n = fifo_read(f, data, ndata);
+  }
+  atomic_store(&f->waiting, 0);
+  return n;
+}
+
+// This writes up to ndata payloads to the FIFO without blocking
+// Any number of threads may write to a FIFO concurrently
 // If the head runs in to the tail, not all payloads are written
 // The number of payloads written is returned
 int fifo_write(fifo_t *f, const fifo_payload_t *data, int ndata) {
   int i;
-  const fifo_payload_t *p;
-  p = data;
   for (i = 0; i < ndata; i++) {
-    // first check to see if there is space in the buffer
-    if ((f->head + 1 == f->tail) ||
-        ((f->head + 1 == f->size) && (f->tail == 0))) {
-      return i; // no more room
-    } else {
-      f->data[f->head] = *p++;
-      f->head++;                // increment the head
-      if (f->head == f->size) { // check for wrap-around
-        f->head = 0;
+    fifo_slot_t *slot;
+    uint32_t pos = atomic_load_explicit(&f->head, memory_order_relaxed);
+    for (;;) {
+      slot = &f->data[pos & f->mask];
+      uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+      int32_t dif = (int32_t)(seq - pos);
+      if (dif == 0) {
+        // the slot is free, try to claim it
+        if (atomic_compare_exchange_weak_explicit(&f->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        goto full; // the consumer hasn't read this slot yet: no more room
+      } else {
+        pos = atomic_load_explicit(&f->head, memory_order_relaxed); // another producer got here first
       }
     }
+    slot->payload = data[i];
+    // publish the payload to the consumer
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  }
+full:
+  if (i > 0) {
+    fifo_wake(f);
   }
-  return ndata;
+  return i;
 }
 
 // returns true if the FIFO has data available
 bool fifo_data_available(fifo_t *f) {
-    return(f->tail != f->head);
+  uint32_t pos = atomic_load_explicit(&f->tail, memory_order_relaxed);
+  uint32_t seq = atomic_load_explicit(&f->data[pos & f->mask].seq, memory_order_acquire);
+  return (int32_t)(seq - (pos + 1)) >= 0;
 }
 
 // clears all entries in the FIFO
+// must be called by the consumer
 void fifo_clear(fifo_t *f) {
-    f->tail = f->head = 0;
-}
\ No newline at end of file
+  fifo_payload_t p;
+  while (fifo_read(f, &p, 1) == 1) {
+  }
+}
+
+// marks the FIFO as closed and wakes up the consumer, so it can finish
+void fifo_close(fifo_t *f) {
+  atomic_store(&f->closed, true);
+  atomic_fetch_add(&f->futex, 1);
+  fifo_futex_wake(&f->futex);
+}
+
+// returns true once fifo_close() has been called
+bool fifo_closed(fifo_t *f) {
+  return atomic_load(&f->closed);
+}
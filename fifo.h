@@ -1,26 +1,46 @@
 #ifndef _FIFO_H_
 #define _FIFO_H_
 
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include "fifo_payload.h"
 
 #define RT_CLOCK CLOCK_REALTIME
 
+#define FIFO_CACHELINE 64
+
+// A bounded lock-free queue for any number of producers and a single consumer.
+// Each slot carries a sequence number that tells whether it is free or holds a payload,
+// so producers only contend on the head and never on the consumer's tail.
+// A consumer can block on an empty queue with fifo_read_wait(), which sleeps on a futex.
+typedef struct FIFO_SLOT_T {
+  _Atomic uint32_t seq;
+  fifo_payload_t payload;
+} fifo_slot_t;
 
 typedef struct FIFO_T {
-  fifo_payload_t *data;
-  int head;
-  int tail;
-  int size;
+  fifo_slot_t *data;
+  uint32_t size; // a power of 2
+  uint32_t mask;
+  alignas(FIFO_CACHELINE) _Atomic uint32_t head;  // next slot to be claimed by a producer
+  alignas(FIFO_CACHELINE) _Atomic uint32_t tail;  // next slot to be read by the consumer
+  alignas(FIFO_CACHELINE) _Atomic uint32_t futex; // bumped by producers to wake up the consumer
+  _Atomic uint32_t waiting;                       // the consumer is (about to go) asleep
+  _Atomic bool closed;                            // no more payloads will be written
 } fifo_t;
 
 fifo_t *fifo_create(int size);
 void fifo_destroy(fifo_t *f);
 
 int fifo_read(fifo_t *f, fifo_payload_t *data, int ndata);
+int fifo_read_wait(fifo_t *f, fifo_payload_t *data, int ndata, int timeout_ms);
 int fifo_write(fifo_t *f, const fifo_payload_t *data, int ndata);
 bool fifo_data_available(fifo_t *f);
 void fifo_clear(fifo_t *f);
+void fifo_close(fifo_t *f);
+bool fifo_closed(fifo_t *f);
 
-#endif //_FIFO_H_
\ No newline at end of file
+#endif //_FIFO_H_
@@ -13,6 +13,8 @@ typedef struct FIFO_PAYLOAD_T {
     int lusid;
     struct timespec64 ts_start;
     struct timespec64 ts_end;
+    long micros;        // time between start and end, filled in when the pair is complete
+    double kmph;        // the resulting speed
 } fifo_payload_t;
 
 #endif // _FIFO_PAYLOAD_
\ No newline at end of file
@@ -0,0 +1,404 @@
+/*
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//
+// Offline analyzer for recorded gpiots timestamp streams
+//
+// Reads either the CSV output of client/gpiots_client ("index,sec,nsec" lines) or, with -b,
+// raw struct gpio_ts_event records as read from the merged device, and computes for each GPIO
+// the intervals between interrupts with their jitter statistics, percentiles and histogram,
+// and for each lus (a pair of GPIOs: start = 2 * lus, end = 2 * lus + 1) the vehicle speeds.
+//
+// The timestamps are kept in one column (array of nanoseconds) per GPIO, so the inner loops are
+// straight passes over contiguous int64 arrays. The integer passes vectorize at -O3, the double
+// reductions only with -fopenmp-simd, on CPUs that convert int64 to double in vector registers.
+// The GPIOs and lussen are spread over a pool of threads.
+//
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gpiots_event.h"
+
+#define MAX_PINS 64
+#define DEFAULT_DISTANCE 0.25 // distance between the start and end detectors of a lus in meters
+#define NSEC_PER_SEC 1000000000LL
+
+// one column of timestamps, in nanoseconds
+typedef struct COLUMN_T {
+    int64_t *ts;
+    size_t n;
+    size_t capacity;
+} column_t;
+
+typedef struct PIN_STATS_T {
+    size_t nintervals;
+    int64_t min, max;
+    double mean, stddev;
+    int64_t p50, p90, p99, p999;
+    uint64_t *histogram;  // nbuckets + 1, the last one counts everything beyond
+} pin_stats_t;
+
+typedef struct LUS_STATS_T {
+    size_t npairs;
+    size_t unmatched;
+    double min_kmph, max_kmph, mean_kmph;
+} lus_stats_t;
+
+static column_t columns[MAX_PINS];
+static int npins;
+static pin_stats_t pin_stats[MAX_PINS];
+static lus_stats_t lus_stats[MAX_PINS / 2];
+static int64_t bucket_ns = 0;   // histogram bucket width, 0 means no histogram
+static int nbuckets = 50;
+static double distance = DEFAULT_DISTANCE;
+static atomic_int next_task;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void column_append(int pin, int64_t ts) {
+    column_t *c = &columns[pin];
+    if (c->n == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 4096;
+        c->ts = realloc(c->ts, c->capacity * sizeof(int64_t));
+        if (c->ts == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    c->ts[c->n++] = ts;
+    if (pin >= npins) {
+        npins = pin + 1;
+    }
+}
+
+// parse the "index,sec,nsec" lines written by gpiots_client
+static size_t load_csv(const char *p, size_t len) {
+    const char *end = p + len;
+    size_t nevents = 0;
+    while (p < end) {
+        int64_t v[3] = { 0, 0, 0 };
+        int field = 0;
+        while ((p < end) && (*p != '\n')) {
+            if ((*p >= '0') && (*p <= '9')) {
+                v[field] = v[field] * 10 + (*p - '0');
+            } else if ((*p == ',') && (field < 2)) {
+                field++;
+            }
+            p++;
+        }
+        p++;
+        if ((field == 2) && (v[0] < MAX_PINS)) {
+            column_append((int)v[0], v[1] * NSEC_PER_SEC + v[2]);
+            nevents++;
+        }
+    }
+    return nevents;
+}
+
+// take the struct gpio_ts_event records read from the merged device
+static size_t load_binary(const char *p, size_t len) {
+    size_t nevents = len / sizeof(struct gpio_ts_event);
+    const struct gpio_ts_event *e = (const struct gpio_ts_event *)p;
+    for (size_t i = 0; i < nevents; i++) {
+        if (e[i].index < MAX_PINS) {
+            column_append(e[i].index, e[i].tv_sec * NSEC_PER_SEC + e[i].tv_nsec);
+        }
+    }
+    return nevents;
+}
+
+static size_t load_file(const char *name, bool binary) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        perror(name);
+        exit(1);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    const char *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        perror(name);
+        exit(1);
+    }
+    madvise((void *)p, st.st_size, MADV_SEQUENTIAL);
+    size_t n = binary ? load_binary(p, st.st_size) : load_csv(p, st.st_size);
+    munmap((void *)p, st.st_size);
+    close(fd);
+    return n;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(const int64_t *sorted, size_t n, double p) {
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+// streams recorded from a single device are ordered, a merged recording may need sorting
+// done once before the analysis, whose passes only read the columns
+static void sort_columns(void) {
+    for (int pin = 0; pin < npins; pin++) {
+        column_t *c = &columns[pin];
+        bool sorted = true;
+        for (size_t i = 1; i < c->n; i++) {
+            sorted &= (c->ts[i] >= c->ts[i - 1]);
+        }
+        if (!sorted) {
+            qsort(c->ts, c->n, sizeof(int64_t), cmp_int64);
+        }
+    }
+}
+
+// intervals, jitter statistics, percentiles and histogram of one GPIO
+static void analyze_pin(int pin) {
+    const column_t *c = &columns[pin];
+    pin_stats_t *s = &pin_stats[pin];
+    if (c->n < 2) {
+        return;
+    }
+
+    size_t n = c->n - 1;
+    int64_t *restrict diff = malloc(n * sizeof(int64_t));
+    const int64_t *restrict ts = c->ts;
+    for (size_t i = 0; i < n; i++) {
+        diff[i] = ts[i + 1] - ts[i];
+    }
+
+    // min and max in a pass of their own: integer reductions, which the compiler may reorder
+    int64_t mn = diff[0], mx = diff[0];
+#pragma omp simd reduction(min : mn) reduction(max : mx)
+    for (size_t i = 0; i < n; i++) {
+        mn = diff[i] < mn ? diff[i] : mn;
+        mx = diff[i] > mx ? diff[i] : mx;
+    }
+    // the intervals add up to the span of the column, so the mean needs no pass
+    double mean = (double)(ts[n] - ts[0]) / n;
+    // a double sum may only be reordered into vector lanes when the simd pragma allows it (-fopenmp-simd)
+    double sq = 0;
+#pragma omp simd reduction(+ : sq)
+    for (size_t i = 0; i < n; i++) {
+        double d = (double)diff[i] - mean;
+        sq += d * d;
+    }
+    s->nintervals = n;
+    s->min = mn;
+    s->max = mx;
+    s->mean = mean;
+    s->stddev = sqrt(sq / n);
+
+    // scattered increments that may collide: this one stays scalar
+    if (bucket_ns > 0) {
+        s->histogram = calloc(nbuckets + 1, sizeof(uint64_t));
+        for (size_t i = 0; i < n; i++) {
+            int64_t b = diff[i] / bucket_ns;
+            s->histogram[b < nbuckets ? b : nbuckets]++;
+        }
+    }
+
+    qsort(diff, n, sizeof(int64_t), cmp_int64);
+    s->p50 = percentile(diff, n, 0.50);
+    s->p90 = percentile(diff, n, 0.90);
+    s->p99 = percentile(diff, n, 0.99);
+    s->p999 = percentile(diff, n, 0.999);
+    free(diff);
+}
+
+// pair the start and end timestamps of a lus and compute the speeds
+// every start is matched with the first end that follows it, before the next start
+static void analyze_lus(int lus) {
+    const column_t *start = &columns[2 * lus];
+    const column_t *end = &columns[2 * lus + 1];
+    lus_stats_t *s = &lus_stats[lus];
+    size_t cap = start->n < end->n ? start->n : end->n;
+    if (cap == 0) {
+        s->unmatched = start->n + end->n;
+        return;
+    }
+    int64_t *restrict travel = malloc(cap * sizeof(int64_t));
+    size_t npairs = 0;
+    size_t j = 0;
+    for (size_t i = 0; (i < start->n) && (j < end->n); i++) {
+        while ((j < end->n) && (end->ts[j] <= start->ts[i])) {
+            j++;
+        }
+        if ((j < end->n) && ((i + 1 == start->n) || (end->ts[j] < start->ts[i + 1]))) {
+            travel[npairs++] = end->ts[j++] - start->ts[i];
+        }
+    }
+    s->npairs = npairs;
+    s->unmatched = start->n + end->n - 2 * npairs;
+    if (npairs == 0) {
+        free(travel);
+        return;
+    }
+
+    // kmph = distance / travel time, with the time in nanoseconds
+    // the speeds are only reduced, so they're computed in the same pass
+    const double k = distance * 3.6e9;
+    double mn = k / (double)travel[0], mx = mn, sum = 0;
+#pragma omp simd reduction(min : mn) reduction(max : mx) reduction(+ : sum)
+    for (size_t i = 0; i < npairs; i++) {
+        double kmph = k / (double)travel[i];
+        mn = kmph < mn ? kmph : mn;
+        mx = kmph > mx ? kmph : mx;
+        sum += kmph;
+    }
+    s->min_kmph = mn;
+    s->max_kmph = mx;
+    s->mean_kmph = sum / npairs;
+    free(travel);
+}
+
+// tasks 0 .. npins-1 are GPIOs, the following ones are lussen
+static void *analyze_thread(void *arg) {
+    int nlussen = npins / 2;
+    for (;;) {
+        int task = atomic_fetch_add(&next_task, 1);
+        if (task < npins) {
+            analyze_pin(task);
+        } else if (task < npins + nlussen) {
+            analyze_lus(task - npins);
+        } else {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void report(void) {
+    for (int pin = 0; pin < npins; pin++) {
+        pin_stats_t *s = &pin_stats[pin];
+        printf("gpio %d: %zu events", pin, columns[pin].n);
+        if (s->nintervals == 0) {
+            printf("\n");
+            continue;
+        }
+        printf(", interval us: min %.3f max %.3f mean %.3f jitter(stddev) %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f\n",
+               s->min / 1e3, s->max / 1e3, s->mean / 1e3, s->stddev / 1e3, s->p50 / 1e3, s->p90 / 1e3, s->p99 / 1e3, s->p999 / 1e3);
+        if (s->histogram != NULL) {
+            for (int b = 0; b <= nbuckets; b++) {
+                if (s->histogram[b] == 0) {
+                    continue;
+                }
+                if (b < nbuckets) {
+                    printf("  %10.1f us: %" PRIu64 "\n", (double)(b * bucket_ns) / 1e3, s->histogram[b]);
+                } else {
+                    printf("  %9.1f+ us: %" PRIu64 "\n", (double)(b * bucket_ns) / 1e3, s->histogram[b]);
+                }
+            }
+        }
+    }
+    for (int lus = 0; lus < npins / 2; lus++) {
+        lus_stats_t *s = &lus_stats[lus];
+        printf("lus %d: %zu vehicles, %zu unmatched timestamps", lus, s->npairs, s->unmatched);
+        if (s->npairs > 0) {
+            printf(", kmph: min %.0f max %.0f mean %.1f", s->min_kmph, s->max_kmph, s->mean_kmph);
+        }
+        printf("\n");
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-b] [-t threads] [-w bucket_us] [-n buckets] [-d distance_m] file...\n", prog);
+    fprintf(stderr, "  -b  files contain struct gpio_ts_event records instead of gpiots_client CSV output\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+
+    bool binary = false;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "bt:w:n:d:")) != -1) {
+        switch (opt) {
+        case 'b':
+            binary = true;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'w':
+            bucket_ns = (int64_t)(atof(optarg) * 1000);
+            break;
+        case 'n':
+            nbuckets = atoi(optarg);
+            break;
+        case 'd':
+            distance = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ((optind >= argc) || (nthreads < 1) || (nbuckets < 1)) {
+        usage(argv[0]);
+    }
+
+    double t0 = now();
+    size_t nevents = 0;
+    for (int i = optind; i < argc; i++) {
+        nevents += load_file(argv[i], binary);
+    }
+    sort_columns();
+    double t1 = now();
+
+    pthread_t threads[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, analyze_thread, NULL);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double t2 = now();
+
+    report();
+    fprintf(stderr, "%zu events: load %.3f s (%.0f events/s), analysis %.3f s (%.0f events/s) on %d threads\n", nevents, t1 - t0,
+            nevents / (t1 - t0), t2 - t1, nevents / (t2 - t1), nthreads);
+
+    exit(0);
+}
@@ -0,0 +1,116 @@
+/*
+
+The buffer of a triggered burst capture
+
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include "gpiots_capture.h"
+
+// vmalloc_array() checks the multiplication for overflow, older kernels only have array_size()
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+#define vmalloc_array(n, size) vmalloc(array_size(n, size))
+#endif
+
+// This initializes a capture buffer for at most size events
+gpio_capture_t *gpio_capture_create(int size) {
+    gpio_capture_t *c = (gpio_capture_t *)kzalloc(sizeof(gpio_capture_t), GFP_KERNEL);
+    if (c == NULL) {
+        printk(KERN_ERR "capture_create: out of memory\n");
+        return NULL;
+    }
+    c->size = size;
+    c->data = (struct gpio_ts_event *)vmalloc_array(size, sizeof(struct gpio_ts_event));
+    if (c->data == NULL) {
+        printk(KERN_ERR "capture_create: out of memory\n");
+        kfree(c);
+        return NULL;
+    }
+    init_waitqueue_head(&c->waitqueue);
+    return c;
+}
+
+// release the allocated memory for the capture buffer
+void gpio_capture_destroy(gpio_capture_t *c) {
+    if (c != NULL) {
+        vfree(c->data);
+        kfree(c);
+    }
+}
+
+// empty the buffer for a new capture of pre events before and post events after the trigger
+void gpio_capture_reset(gpio_capture_t *c, int pre, int post) {
+    c->pre = pre;
+    c->post = post;
+    c->head = 0;
+    c->npre = 0;
+    c->count = 0;
+}
+
+// add an event before the trigger, overwriting the oldest one if the ring is full
+void gpio_capture_add_pre(gpio_capture_t *c, const struct gpio_ts_event *event) {
+    if (c->pre == 0) {
+        return;
+    }
+    c->data[c->head] = *event;
+    c->head++;
+    if (c->head == c->pre) { // check for wrap-around
+        c->head = 0;
+    }
+    if (c->npre < c->pre) {
+        c->npre++;
+    }
+}
+
+// add the trigger or an event after it
+// returns true when the capture is complete
+bool gpio_capture_add(gpio_capture_t *c, const struct gpio_ts_event *event) {
+    if (c->count <= c->post) {
+        c->data[c->pre + c->count] = *event;
+        c->count++;
+    }
+    return c->count > c->post;
+}
+
+// This copies the captured events in time order: the pre-trigger events, the trigger and the events after it
+// The number of events copied is returned
+int gpio_capture_read(gpio_capture_t *c, struct gpio_ts_event *data) {
+    int i;
+    int pos = c->head - c->npre;
+
+    if (pos < 0) {
+        pos += c->pre;
+    }
+    for (i = 0; i < c->npre; i++) {
+        data[i] = c->data[pos];
+        pos++;
+        if (pos == c->pre) {
+            pos = 0;
+        }
+    }
+    memcpy(&data[c->npre], &c->data[c->pre], c->count * sizeof(struct gpio_ts_event));
+    return c->npre + c->count;
+}
@@ -0,0 +1,56 @@
+/*
+
+The buffer of a triggered burst capture
+
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _GPIOTS_CAPTURE_H_
+#define _GPIOTS_CAPTURE_H_
+
+#include <linux/wait.h>
+#include "gpiots_event.h"
+
+// The buffer of a capture session, preallocated so that the ISRs never allocate.
+// Before the trigger the last pre events are kept in a ring at the start of the buffer,
+// the trigger and the post events after it are stored behind that ring.
+typedef struct GPIO_CAPTURE_T {
+    struct gpio_ts_event *data;
+    int size;   // capacity: pre + 1 + post must fit
+    int pre;    // depth of the pre-trigger ring
+    int post;   // number of events recorded after the trigger
+    int head;   // where the next pre-trigger event goes
+    int npre;   // events in the pre-trigger ring
+    int count;  // trigger and post-trigger events recorded
+    wait_queue_head_t waitqueue;    // woken up when the capture is complete
+} gpio_capture_t;
+
+gpio_capture_t *gpio_capture_create(int size);
+void gpio_capture_destroy(gpio_capture_t *c);
+
+void gpio_capture_reset(gpio_capture_t *c, int pre, int post);
+void gpio_capture_add_pre(gpio_capture_t *c, const struct gpio_ts_event *event);
+bool gpio_capture_add(gpio_capture_t *c, const struct gpio_ts_event *event);
+int gpio_capture_read(gpio_capture_t *c, struct gpio_ts_event *data);
+
+#endif //_GPIOTS_CAPTURE_H_
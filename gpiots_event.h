@@ -0,0 +1,52 @@
+/*
+
+The timestamped event record shared by the gpiots kernel module and its users
+
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _GPIOTS_EVENT_H_
+#define _GPIOTS_EVENT_H_
+
+#include <linux/types.h>
+
+// event flags
+#define GPIO_TS_EVENT_OVERFLOW 0x01 // events were dropped just before this one
+#define GPIO_TS_EVENT_PULSE 0x02    // a pulse width record: the timestamp is the rising edge that starts the period
+#define GPIO_TS_EVENT_POLLED 0x04   // found by polling during an interrupt storm: the edge was up to one poll period earlier
+#define GPIO_TS_EVENT_TRIGGER 0x08  // capture: the edge that triggered the capture
+#define GPIO_TS_EVENT_FALLING 0x10  // capture: a falling edge, only seen on the trigger GPIO or in pulse width mode
+
+// a timestamped GPIO interrupt as delivered by the merged device, and by the gpiotsN devices with records=1
+// the layout is fixed size so that 32-bit and 64-bit userspace see the same records
+struct gpio_ts_event {
+    __s64 tv_sec;   // CLOCK_REALTIME timestamp of the interrupt, seconds
+    __s64 tv_nsec;  // and nanoseconds
+    __u32 index;    // index of the gpiots device (the N in /dev/gpiotsN) the interrupt arrived on
+    __u32 flags;    // GPIO_TS_EVENT_* flags
+    __u64 levels;   // levels of the snapshot GPIOs sampled in the ISR, bit i is the i-th GPIO of the snapshot parameter
+    __u32 high_ns;  // pulse width mode: time the input was high, saturates at 4.29 s
+    __u32 low_ns;   // pulse width mode: time the input was low until the next rising edge
+};
+
+#endif //_GPIOTS_EVENT_H_
@@ -1,6 +1,6 @@
 /*
 
-A FIFO buffer for timespec structures
+A FIFO buffer for timestamped GPIO events
 
 Licensed under The MIT License (MIT)
 
@@ -39,7 +39,7 @@ gpio_fifo_t *gpio_fifo_create(int size) {
     f->head = 0;
     f->tail = 0;
     f->size = size + 1;
-    f->data = (struct timespec64 *)kmalloc((size + 1) * sizeof(struct timespec64), GFP_KERNEL);
+    f->data = (struct gpio_ts_event *)kmalloc((size + 1) * sizeof(struct gpio_ts_event), GFP_KERNEL);
     if (f->data == NULL) {
         printk(KERN_ERR "fifo_create: out of memory\n");
         return NULL;
@@ -56,32 +56,32 @@ void gpio_fifo_destroy(gpio_fifo_t *f) {
         kfree(f);
     }
 }
-// This reads up to n timestamps from the FIFO
-// The number of timestamps actually read is returned
-int gpio_fifo_read(gpio_fifo_t *f, struct timespec64 *data, int ntimestamps) {
+// This reads up to n events from the FIFO
+// The number of events actually read is returned
+int gpio_fifo_read(gpio_fifo_t *f, struct gpio_ts_event *data, int nevents) {
     int i;
-    struct timespec64 *p = data;
-    for (i = 0; i < ntimestamps; i++) {
+    struct gpio_ts_event *p = data;
+    for (i = 0; i < nevents; i++) {
         if (f->tail != f->head) {     // see if any data is available
-            *p++ = f->data[f->tail];  // grab a timestamp from the buffer
+            *p++ = f->data[f->tail];  // grab an event from the buffer
             f->tail++;                // increment the tail
             if (f->tail == f->size) { // check for wrap-around
                 f->tail = 0;
             }
         } else {
-            return i; // number of timestamps read
+            return i; // number of events read
         }
     }
-    return ntimestamps;
+    return nevents;
 }
-// This writes up to n timestamps to the FIFO
-// If the head runs in to the tail, not all timestamps are written
-// The number of timestamps actually written is returned
-int gpio_fifo_write(gpio_fifo_t *f, const struct timespec64 *data, int ntimestamps) {
+// This writes up to n events to the FIFO
+// If the head runs in to the tail, not all events are written
+// The number of events actually written is returned
+int gpio_fifo_write(gpio_fifo_t *f, const struct gpio_ts_event *data, int nevents) {
     int i;
-    const struct timespec64 *p;
+    const struct gpio_ts_event *p;
     p = data;
-    for (i = 0; i < ntimestamps; i++) {
+    for (i = 0; i < nevents; i++) {
         // first check to see if there is space in the buffer
         if ((f->head + 1 == f->tail) || ((f->head + 1 == f->size) && (f->tail == 0))) {
             return i; // no more room
@@ -93,7 +93,7 @@ int gpio_fifo_write(gpio_fifo_t *f, const struct timespec64 *data, int ntimestam
             }
         }
     }
-    return ntimestamps;
+    return nevents;
 }
 
 // returns true if the FIFO has data available
@@ -1,6 +1,6 @@
 /*
 
-A FIFO buffer for timespec structures
+A FIFO buffer for timestamped GPIO events
 
 Licensed under The MIT License (MIT)
 
@@ -29,11 +29,12 @@ SOFTWARE.
 #define _GPIOTS_FIFO_H_
 
 #include <linux/time.h>
+#include "gpiots_event.h"
 
 #define RT_CLOCK CLOCK_REALTIME
 
 typedef struct GPIO_FIFO_T {
-    struct timespec64 *data;
+    struct gpio_ts_event *data;
     int head;
     int tail;
     int size;
@@ -42,8 +43,8 @@ typedef struct GPIO_FIFO_T {
 gpio_fifo_t *gpio_fifo_create(int size);
 void gpio_fifo_destroy(gpio_fifo_t *f);
 
-int gpio_fifo_read(gpio_fifo_t *f, struct timespec64 *data, int ntimestamps);
-int gpio_fifo_write(gpio_fifo_t *f, const struct timespec64 *data, int ntimestamps);
+int gpio_fifo_read(gpio_fifo_t *f, struct gpio_ts_event *data, int nevents);
+int gpio_fifo_write(gpio_fifo_t *f, const struct gpio_ts_event *data, int nevents);
 bool gpio_fifo_data_available(gpio_fifo_t *f);
 void gpio_fifo_clear(gpio_fifo_t *f);
 
@@ -0,0 +1,122 @@
+/*
+
+A retained history ring of timestamped GPIO events, searchable by time
+
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include "gpiots_history.h"
+
+// vmalloc_array() checks the multiplication for overflow, older kernels only have array_size()
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+#define vmalloc_array(n, size) vmalloc(array_size(n, size))
+#endif
+
+// This initializes a history ring that retains the last size events
+gpio_history_t *gpio_history_create(int size) {
+    gpio_history_t *h = (gpio_history_t *)kzalloc(sizeof(gpio_history_t), GFP_KERNEL);
+    if (h == NULL) {
+        printk(KERN_ERR "history_create: out of memory\n");
+        return NULL;
+    }
+    h->size = size;
+    h->data = (struct gpio_ts_event *)vmalloc_array(size, sizeof(struct gpio_ts_event));
+    h->keys = (u64 *)vmalloc_array(size, sizeof(u64));
+    if ((h->data == NULL) || (h->keys == NULL)) {
+        printk(KERN_ERR "history_create: out of memory\n");
+        vfree(h->data);
+        vfree(h->keys);
+        kfree(h);
+        return NULL;
+    }
+    return h;
+}
+
+// release the allocated memory for the history
+void gpio_history_destroy(gpio_history_t *h) {
+    if (h != NULL) {
+        vfree(h->data);
+        vfree(h->keys);
+        kfree(h);
+    }
+}
+
+// the position in the ring of the i-th oldest event retained
+static inline int gpio_history_at(gpio_history_t *h, int i) {
+    int pos = h->head - h->count + i;
+    if (pos < 0) {
+        pos += h->size;
+    }
+    return pos;
+}
+
+// index of the first retained event with a key not before t (inclusive) or after t (exclusive)
+static int gpio_history_search(gpio_history_t *h, u64 t, bool inclusive) {
+    int lo = 0;
+    int hi = h->count;
+    int mid;
+    u64 key;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        key = h->keys[gpio_history_at(h, mid)];
+        if (inclusive ? (key < t) : (key <= t)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// add an event, overwriting the oldest one if the history is full
+// the keys must be added in order
+void gpio_history_add(gpio_history_t *h, const struct gpio_ts_event *event, u64 key) {
+    h->data[h->head] = *event;
+    h->keys[h->head] = key;
+    h->head++;
+    if (h->head == h->size) { // check for wrap-around
+        h->head = 0;
+    }
+    if (h->count < h->size) {
+        h->count++;
+    }
+}
+
+// This copies up to n of the events with start <= key <= end, oldest first
+// The number of events in the range is stored in total
+// The number of events actually copied is returned
+int gpio_history_query(gpio_history_t *h, u64 start, u64 end, struct gpio_ts_event *data, int nevents, int *total) {
+    int i;
+    int first = gpio_history_search(h, start, true);
+    int last = gpio_history_search(h, end, false);
+
+    *total = (last > first) ? last - first : 0;
+    for (i = 0; (i < nevents) && (first + i < last); i++) {
+        data[i] = h->data[gpio_history_at(h, first + i)];
+    }
+    return i;
+}
@@ -0,0 +1,50 @@
+/*
+
+A retained history ring of timestamped GPIO events, searchable by time
+
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _GPIOTS_HISTORY_H_
+#define _GPIOTS_HISTORY_H_
+
+#include "gpiots_event.h"
+
+// A ring that keeps the most recent events, overwriting the oldest.
+// Each event is added with a CLOCK_MONOTONIC key, which never goes backwards like the CLOCK_REALTIME timestamp can,
+// so the keys stay in order and a time range is found by binary search.
+typedef struct GPIO_HISTORY_T {
+    struct gpio_ts_event *data;
+    u64 *keys;  // the CLOCK_MONOTONIC key of each event
+    int size;
+    int head;   // where the next event goes
+    int count;  // number of events retained
+} gpio_history_t;
+
+gpio_history_t *gpio_history_create(int size);
+void gpio_history_destroy(gpio_history_t *h);
+
+void gpio_history_add(gpio_history_t *h, const struct gpio_ts_event *event, u64 key);
+int gpio_history_query(gpio_history_t *h, u64 start, u64 end, struct gpio_ts_event *data, int nevents, int *total);
+
+#endif //_GPIOTS_HISTORY_H_
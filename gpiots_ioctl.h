@@ -0,0 +1,89 @@
+/*
+
+The ioctl interface of the gpiots devices
+
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _GPIOTS_IOCTL_H_
+#define _GPIOTS_IOCTL_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#include "gpiots_event.h"
+
+#define GPIO_TS_IOC_MAGIC 'g'
+
+// a point in time, in the CLOCK_REALTIME domain of the event timestamps
+struct gpio_ts_time {
+    __s64 tv_sec;
+    __s64 tv_nsec;
+};
+
+// GPIO_TS_IOC_QUERY: copy the retained events with start <= timestamp <= end
+// the events stay in the FIFO, so this doesn't disturb read()
+struct gpio_ts_query {
+    struct gpio_ts_time start;
+    struct gpio_ts_time end;
+    __u64 events;       // in: userspace pointer to an array of struct gpio_ts_event
+    __u32 max_events;   // in: size of that array
+    __u32 nevents;      // out: number of events copied, the oldest ones of the range first
+    __u32 total;        // out: number of retained events in the range, can be more than max_events
+    __u32 padding;
+};
+
+// GPIO_TS_IOC_STATS: how the interrupts of the device have been captured since the module was loaded,
+// and how long it took to store them
+struct gpio_ts_stats {
+    __u64 irq_ns;       // time spent capturing with the IRQ, while the device or the merged device was open
+    __u64 polled_ns;    // time spent polling the line with the IRQ masked, because of an interrupt storm
+    __u32 storms;       // number of times the interrupt rate passed the storm threshold
+    __u32 polling;      // 1 if the line is being polled right now
+    __u64 store_count;  // number of events stored in the FIFO
+    __u64 store_ns;     // total delay from the interrupt to the FIFO insert, store_ns / store_count is the average
+    __u64 store_max_ns; // maximum delay from the interrupt to the FIFO insert
+};
+
+// the trigger edges of a capture
+#define GPIO_TS_CAPTURE_RISING 1
+#define GPIO_TS_CAPTURE_FALLING 2
+#define GPIO_TS_CAPTURE_BOTH 3
+
+// GPIO_TS_IOC_CAPTURE_ARM: the capture session of the gpiotscapture device
+// gpio indexes are those of the gpiots devices (the N in /dev/gpiotsN)
+struct gpio_ts_capture {
+    __u32 trigger;      // index of the GPIO that triggers the capture
+    __u32 edge;         // GPIO_TS_CAPTURE_* edge of the trigger GPIO
+    __u32 targets;      // bitmask of the indexes of the GPIOs whose edges are recorded
+    __u32 pre;          // number of events before the trigger to keep
+    __u32 post;         // number of events after the trigger to record
+    __u32 padding;
+};
+
+#define GPIO_TS_IOC_QUERY _IOWR(GPIO_TS_IOC_MAGIC, 1, struct gpio_ts_query)
+#define GPIO_TS_IOC_STATS _IOR(GPIO_TS_IOC_MAGIC, 2, struct gpio_ts_stats)
+#define GPIO_TS_IOC_CAPTURE_ARM _IOW(GPIO_TS_IOC_MAGIC, 3, struct gpio_ts_capture)
+#define GPIO_TS_IOC_CAPTURE_DISARM _IO(GPIO_TS_IOC_MAGIC, 4)
+
+#endif //_GPIOTS_IOCTL_H_
@@ -0,0 +1,215 @@
+/*
+
+Per-CPU lockless staging rings for the merged multi-GPIO event stream
+
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <asm/barrier.h>
+#include "gpiots_merge.h"
+
+#define GPIO_MERGE_RING_MASK (GPIO_MERGE_RING_SIZE - 1)
+
+// the timer only wakes up the reader, which reads what has become old enough
+static enum hrtimer_restart gpio_merge_wakeup(struct hrtimer *timer) {
+    gpio_merge_t *m = container_of(timer, gpio_merge_t, timer);
+
+    wake_up(&m->waitqueue);
+    return HRTIMER_NORESTART;
+}
+
+// allocate a staging ring for each possible CPU
+gpio_merge_t *gpio_merge_create(void) {
+    gpio_merge_t *m = (gpio_merge_t *)kzalloc(sizeof(gpio_merge_t), GFP_KERNEL);
+    if (m == NULL) {
+        printk(KERN_ERR "merge_create: out of memory\n");
+        return NULL;
+    }
+    m->rings = alloc_percpu(gpio_merge_ring_t);
+    if (m->rings == NULL) {
+        printk(KERN_ERR "merge_create: out of per-cpu memory\n");
+        kfree(m);
+        return NULL;
+    }
+    init_waitqueue_head(&m->waitqueue);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+    hrtimer_setup(&m->timer, gpio_merge_wakeup, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+    hrtimer_init(&m->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    m->timer.function = gpio_merge_wakeup;
+#endif
+    return m;
+}
+
+// release the per-CPU rings
+void gpio_merge_destroy(gpio_merge_t *m) {
+    if (m != NULL) {
+        hrtimer_cancel(&m->timer);
+        free_percpu(m->rings);
+        kfree(m);
+    }
+}
+
+// append an event to the ring of the current CPU, key is the CLOCK_MONOTONIC time of its interrupt
+// must be called from the ISR, so that nothing else runs on this CPU's ring meanwhile
+// returns false if the ring is full and the event was dropped
+bool gpio_merge_write(gpio_merge_t *m, const struct gpio_ts_event *event, u64 key) {
+    gpio_merge_ring_t *r = this_cpu_ptr(m->rings);
+    unsigned int head = r->head;
+    struct gpio_ts_event *slot;
+
+    // the acquire pairs with the release of the reader that freed the slot
+    if (head - smp_load_acquire(&r->tail) >= GPIO_MERGE_RING_SIZE) {
+        r->overflow = true;
+        r->dropped++;
+        return false;
+    }
+    // the keys of a ring must not go backwards: that only happens when IRQs are force threaded,
+    // and an ISR is preempted between its timestamp and this write by another one on this CPU
+    if (key < r->last_key) {
+        key = r->last_key;
+    }
+    r->last_key = key;
+    r->keys[head & GPIO_MERGE_RING_MASK] = key;
+    slot = &r->data[head & GPIO_MERGE_RING_MASK];
+    *slot = *event;
+    if (r->overflow) {
+        slot->flags |= GPIO_TS_EVENT_OVERFLOW;
+        r->overflow = false;
+    }
+    // publish the event to the reader
+    smp_store_release(&r->head, head + 1);
+    return true;
+}
+
+// account the time spent in one ISR invocation on the current CPU
+void gpio_merge_account(gpio_merge_t *m, u64 isr_ns) {
+    gpio_merge_ring_t *r = this_cpu_ptr(m->rings);
+
+    r->isr_count++;
+    r->isr_ns += isr_ns;
+    if (isr_ns > r->isr_max_ns) {
+        r->isr_max_ns = isr_ns;
+    }
+}
+
+// This reads up to n events from all rings, merged into the order of their keys
+// Each ring is ordered by itself, so a k-way merge over the ring tails suffices
+// An ISR on another CPU may still be storing an event older than the ones visible now, so the events younger than
+// the horizon are held back: as long as no ISR takes longer than that from its timestamp to the ring write,
+// every event up to the horizon is in a ring, and the stream is in order across reads too
+// now is the current CLOCK_MONOTONIC time
+// The number of events actually read is returned
+int gpio_merge_read(gpio_merge_t *m, struct gpio_ts_event *data, int nevents, u64 now) {
+    int i;
+    int cpu;
+    u64 key;
+    u64 oldest_key = 0;
+    u64 horizon = now - GPIO_MERGE_HORIZON_NS;
+    gpio_merge_ring_t *r;
+    gpio_merge_ring_t *oldest;
+
+    // snapshot what every CPU has published so far
+    for_each_possible_cpu(cpu) {
+        r = per_cpu_ptr(m->rings, cpu);
+        r->limit = smp_load_acquire(&r->head);
+    }
+    for (i = 0; i < nevents; i++) {
+        oldest = NULL;
+        for_each_possible_cpu(cpu) {
+            r = per_cpu_ptr(m->rings, cpu);
+            if (r->tail == r->limit) {
+                continue;
+            }
+            key = r->keys[r->tail & GPIO_MERGE_RING_MASK];
+            if ((key <= horizon) && ((oldest == NULL) || (key < oldest_key))) {
+                oldest = r;
+                oldest_key = key;
+            }
+        }
+        if (oldest == NULL) {
+            return i; // all rings drained up to the horizon
+        }
+        data[i] = oldest->data[oldest->tail & GPIO_MERGE_RING_MASK];
+        // hand the slot back to the producer
+        smp_store_release(&oldest->tail, oldest->tail + 1);
+    }
+    return nevents;
+}
+
+// returns true if any ring has data available that is older than the horizon
+// otherwise, if younger events are held back, the timer wakes up the waitqueue when the oldest one can be read
+// now is the current CLOCK_MONOTONIC time
+// must be called by the reader, it looks at the ring tails
+bool gpio_merge_poll(gpio_merge_t *m, u64 now) {
+    int cpu;
+    u64 oldest_key = U64_MAX;
+    gpio_merge_ring_t *r;
+
+    for_each_possible_cpu(cpu) {
+        r = per_cpu_ptr(m->rings, cpu);
+        if (r->tail != smp_load_acquire(&r->head)) {
+            oldest_key = min(oldest_key, r->keys[r->tail & GPIO_MERGE_RING_MASK]);
+        }
+    }
+    if (oldest_key == U64_MAX) {
+        return false;
+    }
+    if (oldest_key + GPIO_MERGE_HORIZON_NS <= now) {
+        return true;
+    }
+    hrtimer_start(&m->timer, ns_to_ktime(oldest_key + GPIO_MERGE_HORIZON_NS), HRTIMER_MODE_ABS);
+    return false;
+}
+
+// discards all events in all rings
+// only the consumer side is touched, so this is safe while ISRs are running
+void gpio_merge_clear(gpio_merge_t *m) {
+    int cpu;
+    gpio_merge_ring_t *r;
+
+    for_each_possible_cpu(cpu) {
+        r = per_cpu_ptr(m->rings, cpu);
+        smp_store_release(&r->tail, READ_ONCE(r->head));
+    }
+}
+
+// log the ISR time and overflow statistics of each CPU
+void gpio_merge_report(gpio_merge_t *m) {
+    int cpu;
+    gpio_merge_ring_t *r;
+
+    for_each_possible_cpu(cpu) {
+        r = per_cpu_ptr(m->rings, cpu);
+        if (r->isr_count == 0) {
+            continue;
+        }
+        printk(KERN_INFO "GPIOTS: cpu %d: %llu interrupts, ISR avg %llu ns, max %llu ns, %llu events dropped\n", cpu,
+               r->isr_count, div64_u64(r->isr_ns, r->isr_count), r->isr_max_ns, r->dropped);
+    }
+}
@@ -0,0 +1,78 @@
+/*
+
+Per-CPU lockless staging rings for the merged multi-GPIO event stream
+
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _GPIOTS_MERGE_H_
+#define _GPIOTS_MERGE_H_
+
+#include <linux/cache.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+#include "gpiots_event.h"
+
+#define GPIO_MERGE_RING_SIZE 256 // size of the staging ring of each CPU, must be a power of 2
+#define GPIO_MERGE_HORIZON_NS (1 * NSEC_PER_MSEC) // events younger than this are held back, see gpio_merge_read()
+
+// A single producer / single consumer ring, one for each CPU.
+// The producer is whatever ISR runs on the owning CPU, the consumer is the reader of the merged device.
+// Each event comes with a CLOCK_MONOTONIC key, the time of its interrupt, that orders the merge.
+// Producer and consumer fields live in separate cache lines so they never bounce between CPUs.
+typedef struct GPIO_MERGE_RING_T {
+    // producer side, only written by the owning CPU in interrupt context
+    unsigned int head ____cacheline_aligned_in_smp;
+    bool overflow;      // the next event written must carry GPIO_TS_EVENT_OVERFLOW
+    u64 last_key;       // the key of the last event written
+    u64 dropped;        // number of events dropped because the ring was full
+    u64 isr_count;      // ISR time accounting
+    u64 isr_ns;
+    u64 isr_max_ns;
+    // consumer side, only written by the reader
+    unsigned int tail ____cacheline_aligned_in_smp;
+    unsigned int limit; // snapshot of head taken at the start of a merge
+    struct gpio_ts_event data[GPIO_MERGE_RING_SIZE] ____cacheline_aligned_in_smp;
+    u64 keys[GPIO_MERGE_RING_SIZE];
+} gpio_merge_ring_t;
+
+typedef struct GPIO_MERGE_T {
+    gpio_merge_ring_t __percpu *rings;
+    wait_queue_head_t waitqueue;        // the waitqueue for poll() support
+    struct hrtimer timer;               // wakes up the waitqueue when the events held back are old enough
+} gpio_merge_t;
+
+gpio_merge_t *gpio_merge_create(void);
+void gpio_merge_destroy(gpio_merge_t *m);
+
+bool gpio_merge_write(gpio_merge_t *m, const struct gpio_ts_event *event, u64 key);
+void gpio_merge_account(gpio_merge_t *m, u64 isr_ns);
+int gpio_merge_read(gpio_merge_t *m, struct gpio_ts_event *data, int nevents, u64 now);
+bool gpio_merge_poll(gpio_merge_t *m, u64 now);
+void gpio_merge_clear(gpio_merge_t *m);
+void gpio_merge_report(gpio_merge_t *m);
+
+#endif //_GPIOTS_MERGE_H_
@@ -41,40 +41,116 @@ SOFTWARE.
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/gpio.h>
+#include <linux/hrtimer.h>
 #include <linux/interrupt.h>
+#include <linux/irq.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
 #include <linux/poll.h>
+#include <linux/pps_kernel.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/version.h>
 #include <linux/wait.h>
 #include <asm/uaccess.h>
 #include <linux/time.h>
 #include <linux/errno.h>
+#include <linux/ktime.h>
+#include <uapi/linux/sched/types.h>
 
+#include "gpiots_capture.h"
 #include "gpiots_fifo.h"
+#include "gpiots_history.h"
+#include "gpiots_ioctl.h"
+#include "gpiots_merge.h"
 
 // ------------------ Default values ----------------------------------------
 
+// the states of a capture session
+#define GPIO_TS_CAPTURE_IDLE 0      // not armed
+#define GPIO_TS_CAPTURE_ARMED 1     // recording the pre-trigger events, waiting for the trigger
+#define GPIO_TS_CAPTURE_TRIGGERED 2 // recording the post-trigger events
+#define GPIO_TS_CAPTURE_DONE 3      // complete, waiting to be read
+
 #define GPIO_TS_CLASS_NAME "gpiots"       // device class name
 #define GPIO_TS_ENTRIES_NAME "gpiots%d"   // device name template
+#define GPIO_TS_MERGED_NAME "gpiotsall"   // name of the merged device
+#define GPIO_TS_CAPTURE_NAME "gpiotscapture" // name of the capture device
 #define GPIO_TS_NB_ENTRIES_MAX 17 // number of GPIOs on R-Pi P1 header.
+#define GPIO_TS_SNAPSHOT_MAX 64   // number of GPIO levels that fit in the levels bitmask of an event
 #define GPIO_TS_FIFO_SIZE 128     // size of FIFO timestamp buffer for each GPIO interrupt 
+#define GPIO_TS_MERGED_READ_MAX 1024 // maximum number of events returned by one read() of the merged device
+#define GPIO_TS_HISTORY_SIZE 1024    // default number of events retained for time range queries, for each GPIO
+#define GPIO_TS_STORM_WINDOW_NS (10 * NSEC_PER_MSEC) // window over which the interrupt rate is measured
+#define GPIO_TS_POLL_US 100          // default poll period during an interrupt storm
+#define GPIO_TS_STAGE_SIZE 64        // threaded mode: events staged by the hard IRQ part for the thread, must be a power of 2
 
 
 // ------------------- Device Info structure --------------------------------
+
+// threaded mode: an edge captured by the hard IRQ part, waiting for the IRQ thread
+struct gpio_ts_staged {
+    struct gpio_ts_event edge;          // timestamp and snapshot levels of the edge
+    struct gpio_ts_event record;        // the event to store: the edge, or the record of a period in pulse width mode
+    bool store;                         // there is a record to store
+    struct pps_event_time pps_ts;       // PPS source: the timestamps of the edge for the PPS event
+    bool pps;                           // the edge is for the PPS source
+    int level;                          // the level right after the edge
+    u64 stamp_ns;                       // CLOCK_MONOTONIC time of the interrupt, for the storm detection and the delay statistics
+    u64 record_ns;                      // CLOCK_MONOTONIC time of the record, the key of the history
+};
+
+// the fields used by the ISR come first, the open/release bookkeeping gets its own cache line
+// so that opening one device never bounces the line another CPU's ISR is using. In threaded mode
+// the head and tail of the staging ring and the ring itself are on separate lines too
 struct gpio_ts_devinfo {
     gpio_fifo_t *fifo;                  // the FIFO buffer that stores the interrupt timestamps
-    spinlock_t spinlock;                // spinlock for protecting FIFO access
+    gpio_history_t *history;            // the most recent events, kept after they have been read, NULL if disabled
+    spinlock_t spinlock;                // spinlock for protecting FIFO and history access
     wait_queue_head_t waitqueue;        // the waitqueue for poll() support
+    int index;                          // the index of the device (minor number)
+    int gpio;                           // the GPIO pin number
+    int irq;                            // the IRQ the GPIO pin is mapped to
+    bool pulsewidth;                    // pulse width mode: record (start, high, low) per period instead of edges
+    s64 pulse_rise_ns;                  // pulse width mode: CLOCK_MONOTONIC rising edge that started the current period, 0 if none
+    s64 pulse_fall_ns;                  // pulse width mode: CLOCK_MONOTONIC falling edge of the current period, 0 if none
+    struct gpio_ts_event pulse_start;   // pulse width mode: the event of the rising edge
+    s64 storm_window_ns;                // CLOCK_MONOTONIC start of the current interrupt rate window
+    int storm_count;                    // interrupts, or polled transitions, in the current window
+    int storm_samples;                  // storm mode: polls in the current window
+    int storm_level;                    // storm mode: the level at the previous poll
+    bool storm_polling;                 // storm mode: the IRQ is masked and the line is polled
+    bool storm_stop;                    // the IRQ is being released, don't switch modes any more
+    struct hrtimer storm_timer;         // storm mode: polls the line
+    u64 storm_since_ns;                 // when the current capture mode was entered
+    u64 irq_ns;                         // time spent capturing with the IRQ
+    u64 polled_ns;                      // time spent polling
+    u32 storms;                         // number of interrupt storms
+    bool capture_edges;                 // capture: the IRQ triggers on both edges for the capture trigger
+    struct pps_device *pps;             // the PPS source fed by the rising edges, NULL if none
+    u64 store_count;                    // number of events stored in the FIFO
+    u64 store_ns;                       // total delay from the interrupt to the FIFO insert
+    u64 store_max_ns;                   // maximum delay
+    int thread_prio;                    // threaded mode: SCHED_FIFO priority of the IRQ thread, 0 for the default
+    bool thread_prio_set;               // threaded mode: the IRQ thread has applied it
+    bool stage_overflow;                // threaded mode: the next staged event must carry GPIO_TS_EVENT_OVERFLOW
+    unsigned int stage_head ____cacheline_aligned_in_smp; // threaded mode: written by the hard IRQ part
+    unsigned int stage_tail ____cacheline_aligned_in_smp; // threaded mode: written by the IRQ thread
+    struct gpio_ts_staged stage[GPIO_TS_STAGE_SIZE] ____cacheline_aligned_in_smp;
+    struct mutex lock ____cacheline_aligned_in_smp; // serializes open/release and IRQ request/free
     int opencount;                      // to ensure exclusive access to each GPIO device
-};
+    int irq_users;                      // number of open devices that need the IRQ (this one and the merged one)
+} ____cacheline_aligned_in_smp;
 
 // ------------------irq handler prototype----------------------------------
 
 static irqreturn_t gpio_ts_handler(int irq, void *devt);
+static irqreturn_t gpio_ts_hardirq(int irq, void *devt);
+static irqreturn_t gpio_ts_thread(int irq, void *devt);
 
 
 //------------------- Module parameters -------------------------------------
@@ -88,94 +164,327 @@ static int use_safe_mode = 0; // defaults to off for backwards compatibility
 // the module parameters definition
 module_param_array_named(gpios, gpio_ts_table, int, &gpio_ts_nb_gpios, 0644);
 module_param_named(safemode, use_safe_mode, int, 0644);
+// per GPIO: whether it is in pulse width mode
+static int gpio_ts_pulsewidth_table[GPIO_TS_NB_ENTRIES_MAX];
+static int gpio_ts_nb_pulsewidth;
+module_param_array_named(pulsewidth, gpio_ts_pulsewidth_table, int, &gpio_ts_nb_pulsewidth, 0444);
+// whether read() returns struct gpio_ts_event records (length in bytes) instead of timestamps
+static int use_records = 0;
+module_param_named(records, use_records, int, 0444);
+// the GPIOs whose levels are sampled in the ISR and stored with every event
+static int gpio_ts_snapshot_table[GPIO_TS_SNAPSHOT_MAX];
+static int gpio_ts_nb_snapshot;
+module_param_array_named(snapshot, gpio_ts_snapshot_table, int, &gpio_ts_nb_snapshot, 0444);
+// whether the merged device gpiotsall, which delivers the events of all GPIOs in timestamp order, is created
+static int use_merged = 0;
+module_param_named(merged, use_merged, int, 0444);
+// the number of events retained per GPIO for the GPIO_TS_IOC_QUERY ioctl, 0 disables the history
+static int gpio_ts_history_size = GPIO_TS_HISTORY_SIZE;
+module_param_named(history, gpio_ts_history_size, int, 0444);
+// the interrupt rate (per second) of a GPIO above which its IRQ is masked and the line is polled, 0 never polls
+static int gpio_ts_storm_rate = 0;
+module_param_named(storm, gpio_ts_storm_rate, int, 0444);
+// the poll period in us during an interrupt storm, which is the timestamp resolution then
+static int gpio_ts_poll_us = GPIO_TS_POLL_US;
+module_param_named(pollus, gpio_ts_poll_us, int, 0444);
+// per GPIO: whether it is also registered as a kernel PPS source
+static int gpio_ts_pps_table[GPIO_TS_NB_ENTRIES_MAX];
+static int gpio_ts_nb_pps;
+module_param_array_named(pps, gpio_ts_pps_table, int, &gpio_ts_nb_pps, 0444);
+// whether the IRQs are requested as threaded IRQs, with only the timestamp taken in hard IRQ context
+static int use_threaded = 0;
+module_param_named(threaded, use_threaded, int, 0444);
+// per GPIO: the SCHED_FIFO priority of its IRQ thread in threaded mode, 0 keeps the kernel default
+static int gpio_ts_priority_table[GPIO_TS_NB_ENTRIES_MAX];
+static int gpio_ts_nb_priority;
+module_param_array_named(priority, gpio_ts_priority_table, int, &gpio_ts_nb_priority, 0444);
+// the number of events the capture device can record, 0 doesn't create it
+static int gpio_ts_capture_size = 0;
+module_param_named(capture, gpio_ts_capture_size, int, 0444);
 
 // ------------------ Driver private data type ------------------------------
 
-// the irq's assigned to the gpios
-static int irq_numbers[GPIO_TS_NB_ENTRIES_MAX];
 // the device info table
 static struct gpio_ts_devinfo *devtable[GPIO_TS_NB_ENTRIES_MAX];
 // global flag to block irq handler on module unload
 static bool module_unload = false;
+// the per-CPU staging rings of the merged device
+static gpio_merge_t *merge;
+// serializes open/release/read of the merged device
+static DEFINE_MUTEX(merged_lock);
+// whether the merged device is open, the ISRs only stage events while it is
+static bool merged_open = false;
+// which snapshot GPIOs were requested by us, rather than being monitored GPIOs already
+static bool snapshot_requested[GPIO_TS_SNAPSHOT_MAX];
+// the storm parameters scaled to one rate window:
+// the number of interrupts that starts polling, the polls per window,
+// and the number of polled transitions at or below which the IRQ is used again
+static int storm_limit;
+static int storm_samples;
+static int storm_exit_limit;
+// the buffer of the capture session
+static gpio_capture_t *capture;
+// serializes open/release/ioctl/read of the capture device
+static DEFINE_MUTEX(capture_lock);
+// protects the capture state and buffer, which the ISRs update
+static DEFINE_SPINLOCK(capture_spinlock);
+// whether the capture device is open
+static bool capture_open = false;
+// whether a capture session is armed, the ISRs only look at the capture while it is
+static bool capture_armed = false;
+// the state of the capture session
+static int capture_state = GPIO_TS_CAPTURE_IDLE;
+// the configuration of the armed capture session
+static struct gpio_ts_capture capture_config;
 
 // ------------------ Driver private methods -------------------------------
 
+//
+// request the IRQ of a device for its first user
+// must be called with devinfo->lock held
+//
+static int gpio_ts_irq_get(struct gpio_ts_devinfo *devinfo) {
+
+    int err;
+    unsigned long flags;
+
+    if (devinfo->irq_users == 0) {
+        // no ISR runs yet, so the pulse width state can be reset without locking
+        devinfo->pulse_rise_ns = 0;
+        devinfo->pulse_fall_ns = 0;
+        devinfo->storm_window_ns = 0;
+        devinfo->storm_polling = false;
+        devinfo->storm_stop = false;
+        devinfo->storm_since_ns = ktime_get_ns();
+        devinfo->stage_head = 0;
+        devinfo->stage_tail = 0;
+        devinfo->stage_overflow = false;
+        devinfo->thread_prio_set = false;
+        flags = IRQF_SHARED | IRQF_TRIGGER_RISING;
+        if (devinfo->pulsewidth)
+            flags |= IRQF_TRIGGER_FALLING;
+        if (use_threaded) {
+            // IRQF_NO_THREAD keeps the hard part in hard IRQ context when IRQs are force threaded (PREEMPT_RT)
+            err = request_threaded_irq(devinfo->irq, gpio_ts_hardirq, gpio_ts_thread, flags | IRQF_NO_THREAD,
+                                       THIS_MODULE->name, devinfo);
+        } else {
+            err = request_irq(devinfo->irq, gpio_ts_handler, flags, THIS_MODULE->name, devinfo);
+        }
+        if (err != 0) {
+            printk(KERN_ERR "GPIOTS: request_irq returned error %d for gpio %d\n", err, devinfo->gpio);
+            return err;
+        }
+    }
+    devinfo->irq_users++;
+
+    return 0;
+}
+
+//
+// add the time since the last capture mode switch to the time spent in the current mode
+// must be called with devinfo->spinlock held
+//
+static void gpio_ts_storm_account(struct gpio_ts_devinfo *devinfo) {
+
+    u64 now = ktime_get_ns();
+
+    if (devinfo->storm_polling)
+        devinfo->polled_ns += now - devinfo->storm_since_ns;
+    else
+        devinfo->irq_ns += now - devinfo->storm_since_ns;
+    devinfo->storm_since_ns = now;
+}
+
+//
+// free the IRQ of a device when its last user is gone
+// storm_stop keeps the ISR and the poll timer from switching modes, so the ISR can't start the poll timer any more
+// the poll timer is stopped before a masked IRQ is unmasked again, so the two never run at the same time
+// free_irq() waits for a running ISR to complete, so no ISR touches the device after this
+// must be called with devinfo->lock held
+//
+static void gpio_ts_irq_put(struct gpio_ts_devinfo *devinfo) {
+
+    unsigned long irqmsk;
+
+    devinfo->irq_users--;
+    if (devinfo->irq_users == 0) {
+        spin_lock_irqsave(&devinfo->spinlock, irqmsk);
+        devinfo->storm_stop = true;
+        spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
+        hrtimer_cancel(&devinfo->storm_timer);
+        spin_lock_irqsave(&devinfo->spinlock, irqmsk);
+        gpio_ts_storm_account(devinfo);
+        if (devinfo->storm_polling) {
+            devinfo->storm_polling = false;
+            enable_irq(devinfo->irq);
+        }
+        spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
+        free_irq(devinfo->irq, devinfo);
+    }
+}
+
 //
 // open the GPIO device, ensuring exclusive access
 // clear the fifo buffer
+// request the IRQ, so that interrupts only cost something while somebody's listening
 // and store the devinfo struct in the private file data
 //
 static int gpio_ts_open(struct inode *ind, struct file *filp) {
 
+    int err;
+    unsigned long irqmsk;
     int gpio_index = iminor(ind);
     struct gpio_ts_devinfo *devinfo = devtable[gpio_index];
+
+    mutex_lock(&devinfo->lock);
     // ensure exclusive access
     if (devinfo->opencount > 0) {
+        mutex_unlock(&devinfo->lock);
         return -EBUSY;
     }
-    gpio_fifo_clear(devinfo->fifo);    
-    devinfo->opencount++;
+    spin_lock_irqsave(&devinfo->spinlock, irqmsk);
+    gpio_fifo_clear(devinfo->fifo);
+    spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
+    err = gpio_ts_irq_get(devinfo);
+    if (err != 0) {
+        mutex_unlock(&devinfo->lock);
+        return err;
+    }
+    WRITE_ONCE(devinfo->opencount, devinfo->opencount + 1);
+    mutex_unlock(&devinfo->lock);
     filp->private_data = devinfo;
 
     return 0;
 }
 
 //
-// close the GPIO device: remove the devinfo struct from the file private data
+// close the GPIO device: release the IRQ and remove the devinfo struct from the file private data
 // 
 static int gpio_ts_release(struct inode *ind, struct file *filp) {
 
     int gpio_index = iminor(ind);
-    devtable[gpio_index]->opencount--;
+    struct gpio_ts_devinfo *devinfo = devtable[gpio_index];
+
+    mutex_lock(&devinfo->lock);
+    WRITE_ONCE(devinfo->opencount, devinfo->opencount - 1);
+    gpio_ts_irq_put(devinfo);
+    mutex_unlock(&devinfo->lock);
     filp->private_data = NULL;
 
     return 0;
 }
 
+//
+// take up to nevents events from the FIFO buffer of a device
+// unless records is set, they are compacted into an array of timespec64 structs in place
+// returns the number of events taken
+//
+static int gpio_ts_fetch(struct gpio_ts_devinfo *devinfo, struct gpio_ts_event *kbuffer, size_t nevents, bool records) {
+
+    int i;
+    int nread;
+    struct timespec64 *timestamps;
+    struct timespec64 ts;
+    unsigned long irqmsk;
+
+    spin_lock_irqsave(&devinfo->spinlock, irqmsk);
+    nread = gpio_fifo_read(devinfo->fifo, kbuffer, nevents);
+    spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
+
+    if (!records) {
+        // compact the events into timestamps, in place: timestamp i never overlaps an event after i
+        timestamps = (struct timespec64 *)kbuffer;
+        for (i = 0; i < nread; i++) {
+            ts.tv_sec = kbuffer[i].tv_sec;
+            ts.tv_nsec = kbuffer[i].tv_nsec;
+            timestamps[i] = ts;
+        }
+    }
+    return nread;
+}
+
 //
 // read timestamps from the FIFO buffer, if any
+// by default these are timespec64 structs, with records=1 or in pulse width mode they are struct gpio_ts_event records
 //
 static ssize_t gpio_ts_read(struct file *filp, char *buffer, size_t length, loff_t *offset) {
 
     int nread;
-    ssize_t lg;
+    size_t nevents;
+    size_t recsize;
+    ssize_t lg = 0;
     int err;
-    struct timespec64 *kbuffer;
-    unsigned long irqmsk;
+    struct gpio_ts_event *kbuffer;
 
     struct gpio_ts_devinfo *devinfo = filp->private_data;
-    if (!use_safe_mode) {
-        kbuffer = kmalloc(length * sizeof(struct timespec64), GFP_KERNEL);
+    bool records = use_records || devinfo->pulsewidth;
+    recsize = records ? sizeof(struct gpio_ts_event) : sizeof(struct timespec64);
+    if (!use_safe_mode && !records) {
+        nevents = length;
     } else {
-        if (length % sizeof(struct timespec64) != 0)
+        if (length % recsize != 0)
             return -EFAULT;
-        kbuffer = kmalloc(length, GFP_KERNEL);
+        nevents = length / recsize;
     }
+    // the FIFO never holds more than this
+    nevents = min_t(size_t, nevents, GPIO_TS_FIFO_SIZE);
+    kbuffer = kmalloc_array(nevents, sizeof(struct gpio_ts_event), GFP_KERNEL);
     if (kbuffer == NULL)
         return -ENOMEM;
 
-    spin_lock_irqsave(&devinfo->spinlock, irqmsk);
-    if (!use_safe_mode)
-        nread = gpio_fifo_read(devinfo->fifo, kbuffer, length);
-    else
-        nread = gpio_fifo_read(devinfo->fifo, kbuffer, length / sizeof(struct timespec64));
-    spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
-
+    nread = gpio_ts_fetch(devinfo, kbuffer, nevents, records);
     if (nread > 0) {
-        lg = nread * sizeof(struct timespec64);
+        lg = nread * recsize;
         err = copy_to_user(buffer, kbuffer, lg);
         if (err != 0)
-            return -EFAULT;
+            lg = -EFAULT;
     }
 
     kfree(kbuffer);
 
-    if (!use_safe_mode) 
+    if (lg < 0)
+        return lg;
+    if (!use_safe_mode && !records) 
         return nread;
     else
         return lg;
 }
 
+//
+// read_iter support, which is what splice() and sendfile() use to move the timestamps
+// into a pipe or file without a copy through userspace
+// the length is always in bytes, as in safe mode, and only whole records are transferred
+//
+static ssize_t gpio_ts_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+    int nread;
+    size_t nevents;
+    size_t recsize;
+    ssize_t lg = 0;
+    struct gpio_ts_event *kbuffer;
+
+    struct gpio_ts_devinfo *devinfo = iocb->ki_filp->private_data;
+    bool records = use_records || devinfo->pulsewidth;
+    recsize = records ? sizeof(struct gpio_ts_event) : sizeof(struct timespec64);
+    nevents = min_t(size_t, iov_iter_count(to) / recsize, GPIO_TS_FIFO_SIZE);
+    if (nevents == 0)
+        return (iov_iter_count(to) == 0) ? 0 : -EINVAL;
+    kbuffer = kmalloc_array(nevents, sizeof(struct gpio_ts_event), GFP_KERNEL);
+    if (kbuffer == NULL)
+        return -ENOMEM;
+
+    nread = gpio_ts_fetch(devinfo, kbuffer, nevents, records);
+    if (nread > 0) {
+        lg = nread * recsize;
+        if (copy_to_iter(kbuffer, lg, to) != lg)
+            lg = -EFAULT;
+    }
+
+    kfree(kbuffer);
+
+    return lg;
+}
+
 //
 // poll support: called when the user calls poll() on an open GPIO file, or when woken up
 // by the kernel following a waitqueue wake_up by the ISR
@@ -202,192 +511,1395 @@ static unsigned int gpio_ts_poll(struct file *filp, struct poll_table_struct *po
     return 0;
 }
 
-// ------------------ IRQ handler----------- ----------------------------
+//
+// convert a CLOCK_REALTIME query bound to the CLOCK_MONOTONIC time the history is searched on
+// offset is CLOCK_REALTIME - CLOCK_MONOTONIC now
+// the bound comes from userspace: an open-ended one like { INT64_MAX, 0 } saturates to 0 or U64_MAX
+//
+static u64 gpio_ts_query_key(const struct gpio_ts_time *t, s64 offset) {
+
+    s64 key;
+
+    if (check_mul_overflow((s64)t->tv_sec, (s64)NSEC_PER_SEC, &key) ||
+        check_add_overflow(key, (s64)t->tv_nsec, &key))
+        return (t->tv_sec < 0) ? 0 : U64_MAX;
+    if (check_sub_overflow(key, offset, &key))
+        return (offset > 0) ? 0 : U64_MAX;
+
+    return (key > 0) ? key : 0;
+}
 
 //
-// handles GPIO interrupts
-// ignores interrupts when no file is open for the device
-// otherwise gets the current timestamp
-// then stores the timestamp in the fifo queue for this device 
-// and wakes up the associated waitqueue so that poll() gets woken up if it's waiting
-//  
-static irqreturn_t gpio_ts_handler(int irq, void *arg) {
+// GPIO_TS_IOC_QUERY: copy the retained events within a time range to userspace
+// the history is searched on CLOCK_MONOTONIC, which never steps, with the bounds converted at the current offset
+// the history is only searched under the spinlock, the copy to userspace happens after
+//
+static long gpio_ts_query(struct gpio_ts_devinfo *devinfo, struct gpio_ts_query __user *uquery) {
 
-    struct timespec64 timestamp;
-    struct gpio_ts_devinfo *devinfo;
-    int nwritten;
+    struct gpio_ts_query query;
+    struct gpio_ts_event *kbuffer = NULL;
+    size_t nevents;
+    s64 offset;
+    int nread;
+    int total;
+    long err = 0;
+    unsigned long irqmsk;
 
-    if (module_unload) {
-        return -IRQ_NONE; // ignore if module is unloading
+    if (devinfo->history == NULL)
+        return -ENODATA;
+    if (copy_from_user(&query, uquery, sizeof(query)) != 0)
+        return -EFAULT;
+
+    // the history never holds more than this
+    nevents = min_t(size_t, query.max_events, gpio_ts_history_size);
+    if (nevents > 0) {
+        kbuffer = kvmalloc_array(nevents, sizeof(struct gpio_ts_event), GFP_KERNEL);
+        if (kbuffer == NULL)
+            return -ENOMEM;
     }
 
-    // first of all get the timestamp
-    ktime_get_real_ts64(&timestamp);
+    offset = ktime_get_real_ns() - ktime_get_ns();
+    spin_lock_irqsave(&devinfo->spinlock, irqmsk);
+    nread = gpio_history_query(devinfo->history, gpio_ts_query_key(&query.start, offset),
+                               gpio_ts_query_key(&query.end, offset), kbuffer, nevents, &total);
+    spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
 
-    // get the device info structure for this gpio from the file pointer
-    // note that it's just a pointer to devtable[gpio_index]
-    devinfo = (struct gpio_ts_devinfo *)arg;
-    if (devinfo == NULL) {
-        return -IRQ_NONE;
-    }
-    if (devinfo->opencount <= 0) { // ignore interrupts while nobody's listening
-        return -IRQ_NONE;
-    }
-    // lock the data fifo and insert the timestamp
-    spin_lock(&devinfo->spinlock);
-    nwritten = gpio_fifo_write(devinfo->fifo, &timestamp, 1);
-    spin_unlock(&devinfo->spinlock);
-    if (nwritten != 1) {
-        printk(KERN_ERR "GPIOTS: ISR fifo overflow\n");
+    if ((nread > 0) &&
+        (copy_to_user(u64_to_user_ptr(query.events), kbuffer, nread * sizeof(struct gpio_ts_event)) != 0)) {
+        err = -EFAULT;
+    } else {
+        query.nevents = nread;
+        query.total = total;
+        if (copy_to_user(uquery, &query, sizeof(query)) != 0)
+            err = -EFAULT;
     }
-    wake_up(&devinfo->waitqueue);
+    kvfree(kbuffer);
 
-    return IRQ_HANDLED;
+    return err;
 }
 
-// ------------------ Driver private global data ----------------------------
+//
+// GPIO_TS_IOC_STATS: copy the time spent in each capture mode to userspace
+//
+static long gpio_ts_stats(struct gpio_ts_devinfo *devinfo, struct gpio_ts_stats __user *ustats) {
 
-static struct file_operations gpio_ts_fops = {
-    .owner = THIS_MODULE, 
-    .open = gpio_ts_open, 
-    .release = gpio_ts_release, 
-    .read = gpio_ts_read, 
-    .poll = gpio_ts_poll,
-};
+    struct gpio_ts_stats stats;
+    unsigned long irqmsk;
 
-static dev_t gpio_ts_dev;
-static struct cdev gpio_ts_cdev;
-static struct class *gpio_ts_class = NULL;
+    memset(&stats, 0, sizeof(stats));
+    spin_lock_irqsave(&devinfo->spinlock, irqmsk);
+    gpio_ts_storm_account(devinfo);
+    stats.irq_ns = devinfo->irq_ns;
+    stats.polled_ns = devinfo->polled_ns;
+    stats.storms = devinfo->storms;
+    stats.polling = devinfo->storm_polling;
+    stats.store_count = devinfo->store_count;
+    stats.store_ns = devinfo->store_ns;
+    stats.store_max_ns = devinfo->store_max_ns;
+    spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
 
-// ------------------ Driver init and exit methods --------------------------
+    if (copy_to_user(ustats, &stats, sizeof(stats)) != 0)
+        return -EFAULT;
+    return 0;
+}
 
-// 
-// initalize the device structures for each device
-// create the character devices
-// create the sysfs interface
-// register the ISR for each GPIO device
 //
-static int __init gpio_ts_init(void) {
+// ioctl support
+//
+static long gpio_ts_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+
+    struct gpio_ts_devinfo *devinfo = filp->private_data;
+
+    switch (cmd) {
+    case GPIO_TS_IOC_QUERY:
+        return gpio_ts_query(devinfo, (struct gpio_ts_query __user *)arg);
+    case GPIO_TS_IOC_STATS:
+        return gpio_ts_stats(devinfo, (struct gpio_ts_stats __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+// ------------------ Merged device methods ---------------------------------
+
+//
+// open the merged device, ensuring exclusive access
+// discard stale events and request the IRQs of all GPIOs
+//
+static int gpio_ts_merged_open(struct inode *ind, struct file *filp) {
 
     int err;
     int i;
-    int gpio;
-    int irq;
     struct gpio_ts_devinfo *devinfo;
 
-    // zero device table 
-    for (i = 0; i < GPIO_TS_NB_ENTRIES_MAX; ++i) {
-        devtable[i] = NULL;
-    }
-
-    // sanity checks
-    if (gpio_ts_nb_gpios < 1) {
-        printk(KERN_ERR "%s: I need at least one GPIO input\n", THIS_MODULE->name);
-        return -EINVAL;
+    mutex_lock(&merged_lock);
+    if (merged_open) {
+        mutex_unlock(&merged_lock);
+        return -EBUSY;
     }
-
-    for (i = 0; i < gpio_ts_nb_gpios; ++i) {
-        gpio = gpio_ts_table[i];
-        if (!gpio_is_valid(gpio)) {
-            printk(KERN_ERR "GPIOTS: invalid gpio pin %d\n", gpio);
-            return -ENODEV;
+    gpio_merge_clear(merge);
+    for (i = 0; i < gpio_ts_nb_gpios; i++) {
+        devinfo = devtable[i];
+        mutex_lock(&devinfo->lock);
+        err = gpio_ts_irq_get(devinfo);
+        mutex_unlock(&devinfo->lock);
+        if (err != 0) {
+            while (--i >= 0) {
+                devinfo = devtable[i];
+                mutex_lock(&devinfo->lock);
+                gpio_ts_irq_put(devinfo);
+                mutex_unlock(&devinfo->lock);
+            }
+            mutex_unlock(&merged_lock);
+            return err;
         }
     }
+    WRITE_ONCE(merged_open, true);
+    mutex_unlock(&merged_lock);
+    filp->private_data = merge;
 
-    // create the character devices
+    return 0;
+}
 
-    err = alloc_chrdev_region(&gpio_ts_dev, 0, gpio_ts_nb_gpios, THIS_MODULE->name);
-    if (err != 0) {
-        printk(KERN_ERR "GPIOTS: error %d allocating chdev_region\n", err);
-        return err;
+//
+// close the merged device and release the IRQs it holds
+//
+static int gpio_ts_merged_release(struct inode *ind, struct file *filp) {
+
+    int i;
+    struct gpio_ts_devinfo *devinfo;
+
+    mutex_lock(&merged_lock);
+    WRITE_ONCE(merged_open, false);
+    for (i = 0; i < gpio_ts_nb_gpios; i++) {
+        devinfo = devtable[i];
+        mutex_lock(&devinfo->lock);
+        gpio_ts_irq_put(devinfo);
+        mutex_unlock(&devinfo->lock);
     }
-    printk(KERN_INFO "GPIOTS: device region allocated, major number=%x\n", gpio_ts_dev);
+    mutex_unlock(&merged_lock);
+    filp->private_data = NULL;
 
-    gpio_ts_class = class_create(THIS_MODULE, GPIO_TS_CLASS_NAME);
-    if (IS_ERR(gpio_ts_class)) {
-        printk(KERN_ERR "GPIOTS: Could not create class %s\n", GPIO_TS_CLASS_NAME);
-        unregister_chrdev_region(gpio_ts_dev, gpio_ts_nb_gpios);
+    return 0;
+}
+
+//
+// read events of all GPIOs, merged in timestamp order
+// the length is in bytes and must be a multiple of sizeof(struct gpio_ts_event)
+// the number of bytes read is returned
+//
+static ssize_t gpio_ts_merged_read(struct file *filp, char *buffer, size_t length, loff_t *offset) {
+
+    int nread;
+    size_t nevents;
+    ssize_t lg;
+    struct gpio_ts_event *kbuffer;
+
+    if (length % sizeof(struct gpio_ts_event) != 0)
         return -EINVAL;
-    }
-    printk(KERN_INFO "GPIOTS: device class created\n");
+    nevents = min_t(size_t, length / sizeof(struct gpio_ts_event), GPIO_TS_MERGED_READ_MAX);
+    if (nevents == 0)
+        return 0;
+    kbuffer = kmalloc_array(nevents, sizeof(struct gpio_ts_event), GFP_KERNEL);
+    if (kbuffer == NULL)
+        return -ENOMEM;
 
-    for (i = 0; i < gpio_ts_nb_gpios; i++) {
-        device_create(gpio_ts_class, NULL, MKDEV(MAJOR(gpio_ts_dev), i), NULL, GPIO_TS_ENTRIES_NAME, i);
-        printk(KERN_INFO "GPIOTS: Device %d created\n", i);
+    mutex_lock(&merged_lock);
+    nread = gpio_merge_read(merge, kbuffer, nevents, ktime_get_ns());
+    mutex_unlock(&merged_lock);
 
-        devinfo = kzalloc(sizeof(struct gpio_ts_devinfo), GFP_KERNEL);
-        if (devinfo == NULL)
-            return -ENOMEM;
-        devinfo->fifo = gpio_fifo_create(GPIO_TS_FIFO_SIZE);
-        devinfo->opencount = 0;
-        spin_lock_init(&devinfo->spinlock);
-        init_waitqueue_head(&devinfo->waitqueue);
-        devtable[i] = devinfo;
-    }
+    lg = nread * sizeof(struct gpio_ts_event);
+    if ((nread > 0) && (copy_to_user(buffer, kbuffer, lg) != 0))
+        lg = -EFAULT;
+    kfree(kbuffer);
 
-    cdev_init(&gpio_ts_cdev, &gpio_ts_fops);
+    return lg;
+}
 
-    err = cdev_add(&(gpio_ts_cdev), gpio_ts_dev, gpio_ts_nb_gpios);
-    if (err != 0) {
-        for (i = 0; i < gpio_ts_nb_gpios; i++) {
-            device_destroy(gpio_ts_class, MKDEV(MAJOR(gpio_ts_dev), i));
-            devinfo = devtable[i];
-            gpio_fifo_destroy(devinfo->fifo);
-            kfree(devinfo);
-        }
-        class_destroy(gpio_ts_class);
-        unregister_chrdev_region(gpio_ts_dev, gpio_ts_nb_gpios);
-        return err;
-    }
+//
+// read_iter support for the merged device, for splice() and sendfile()
+//
+static ssize_t gpio_ts_merged_read_iter(struct kiocb *iocb, struct iov_iter *to) {
 
-    // set up sysfs and irqs
+    int nread;
+    size_t nevents;
+    ssize_t lg = 0;
+    struct gpio_ts_event *kbuffer;
+
+    nevents = min_t(size_t, iov_iter_count(to) / sizeof(struct gpio_ts_event), GPIO_TS_MERGED_READ_MAX);
+    if (nevents == 0)
+        return (iov_iter_count(to) == 0) ? 0 : -EINVAL;
+    kbuffer = kmalloc_array(nevents, sizeof(struct gpio_ts_event), GFP_KERNEL);
+    if (kbuffer == NULL)
+        return -ENOMEM;
 
-    for (i = 0; i < gpio_ts_nb_gpios; ++i) {
-        gpio = gpio_ts_table[i];
-        gpio_request(gpio, "sysfs");
-        gpio_direction_input(gpio);
-        gpio_export(gpio, false);
-        printk(KERN_INFO "GPIOTS: gpio %d exported to sysfs for input\n", gpio);
-        irq = gpio_to_irq(gpio);
-        printk(KERN_INFO "GPIOTS: gpio %d mapped to IRQ %d\n", gpio, irq);
-        err = request_irq(irq, gpio_ts_handler, IRQF_SHARED | IRQF_TRIGGER_RISING, THIS_MODULE->name, devtable[i]);
-        if (err != 0) {
-            devinfo = devtable[i];
-            gpio_fifo_destroy(devinfo->fifo);
-            kfree(devinfo);
-            printk(KERN_ERR "GPIOTS: request_irq returned error %d for gpio %d\n", err, gpio);
-            return -ENODEV;
-        }
-        irq_numbers[i] = irq;
+    mutex_lock(&merged_lock);
+    nread = gpio_merge_read(merge, kbuffer, nevents, ktime_get_ns());
+    mutex_unlock(&merged_lock);
+
+    if (nread > 0) {
+        lg = nread * sizeof(struct gpio_ts_event);
+        if (copy_to_iter(kbuffer, lg, to) != lg)
+            lg = -EFAULT;
     }
+    kfree(kbuffer);
+
+    return lg;
+}
+
+//
+// poll support for the merged device
+// the events are readable once they're older than the merge horizon, the merge timer wakes up the poll then
+//
+static unsigned int gpio_ts_merged_poll(struct file *filp, struct poll_table_struct *polltable) {
+
+    bool available;
 
+    poll_wait(filp, &merge->waitqueue, polltable);
+    mutex_lock(&merged_lock);
+    available = gpio_merge_poll(merge, ktime_get_ns());
+    mutex_unlock(&merged_lock);
+    if (available) {
+        return POLLPRI | POLLIN;
+    }
     return 0;
 }
 
+// ------------------ Capture device methods --------------------------------
+
 //
-// clean up the module
-// unregister the ISR for each device
-// remove sysfs interface and devices
-// free the device info structures and associated fifos
+// release the IRQs of the GPIOs in the pins bitmask
 //
-void __exit gpio_ts_exit(void) {
-    int i;
-    int gpio;
-    int irq;
+static void gpio_ts_capture_irq_put(unsigned long pins) {
 
-    module_unload = true;
+    int i;
+    struct gpio_ts_devinfo *devinfo;
 
-    // release IRQ's, clean up sysfs 
     for (i = 0; i < gpio_ts_nb_gpios; i++) {
-        gpio = gpio_ts_table[i];
-        irq = irq_numbers[i];
-        free_irq(irq, devtable[i]);
-        gpio_unexport(gpio);
-        gpio_free(gpio);
-        printk(KERN_INFO "GPIOTS: released gpio %d, irq %d\n", gpio, irq);
+        if (pins & BIT(i)) {
+            devinfo = devtable[i];
+            mutex_lock(&devinfo->lock);
+            gpio_ts_irq_put(devinfo);
+            mutex_unlock(&devinfo->lock);
+        }
+    }
+}
+
+//
+// GPIO_TS_IOC_CAPTURE_ARM: start a capture session
+// request the IRQs of the trigger and target GPIOs, and make the trigger GPIO interrupt
+// on both edges if the trigger edge needs it
+// must be called with capture_lock held
+//
+static long gpio_ts_capture_arm(struct gpio_ts_capture __user *uconfig) {
+
+    struct gpio_ts_capture config;
+    struct gpio_ts_devinfo *devinfo;
+    unsigned long pins;
+    unsigned long irqmsk;
+    int err;
+    int i;
+
+    if (copy_from_user(&config, uconfig, sizeof(config)) != 0)
+        return -EFAULT;
+    if ((config.trigger >= gpio_ts_nb_gpios) || (config.targets == 0) || ((config.targets >> gpio_ts_nb_gpios) != 0) ||
+        (config.edge < GPIO_TS_CAPTURE_RISING) || (config.edge > GPIO_TS_CAPTURE_BOTH) ||
+        (config.pre >= gpio_ts_capture_size) || (config.post >= gpio_ts_capture_size - config.pre))
+        return -EINVAL;
+    if (capture_state != GPIO_TS_CAPTURE_IDLE)
+        return -EBUSY;
+
+    pins = config.targets | BIT(config.trigger);
+    for (i = 0; i < gpio_ts_nb_gpios; i++) {
+        if (pins & BIT(i)) {
+            devinfo = devtable[i];
+            mutex_lock(&devinfo->lock);
+            err = gpio_ts_irq_get(devinfo);
+            mutex_unlock(&devinfo->lock);
+            if (err != 0) {
+                gpio_ts_capture_irq_put(pins & (BIT(i) - 1));
+                return err;
+            }
+        }
+    }
+    // in pulse width mode the IRQ triggers on both edges already
+    devinfo = devtable[config.trigger];
+    if ((config.edge != GPIO_TS_CAPTURE_RISING) && !devinfo->pulsewidth) {
+        WRITE_ONCE(devinfo->capture_edges, true);
+        irq_set_irq_type(devinfo->irq, IRQ_TYPE_EDGE_BOTH);
+    }
+
+    spin_lock_irqsave(&capture_spinlock, irqmsk);
+    gpio_capture_reset(capture, config.pre, config.post);
+    capture_config = config;
+    capture_state = GPIO_TS_CAPTURE_ARMED;
+    spin_unlock_irqrestore(&capture_spinlock, irqmsk);
+    WRITE_ONCE(capture_armed, true);
+
+    return 0;
+}
+
+//
+// stop the capture session, if any, wake up a waiting reader and release the IRQs
+// the ISRs never leave or enter the idle state, so it can be tested without the spinlock
+// must be called with capture_lock held
+//
+static void gpio_ts_capture_disarm(void) {
+
+    struct gpio_ts_devinfo *devinfo;
+    unsigned long irqmsk;
+
+    if (capture_state == GPIO_TS_CAPTURE_IDLE)
+        return;
+    WRITE_ONCE(capture_armed, false);
+    spin_lock_irqsave(&capture_spinlock, irqmsk);
+    capture_state = GPIO_TS_CAPTURE_IDLE;
+    spin_unlock_irqrestore(&capture_spinlock, irqmsk);
+    wake_up_interruptible(&capture->waitqueue);
+
+    devinfo = devtable[capture_config.trigger];
+    if (devinfo->capture_edges) {
+        irq_set_irq_type(devinfo->irq, IRQ_TYPE_EDGE_RISING);
+        // a falling edge that was already pending must still be recognized as one
+        synchronize_irq(devinfo->irq);
+        WRITE_ONCE(devinfo->capture_edges, false);
+    }
+    gpio_ts_capture_irq_put(capture_config.targets | BIT(capture_config.trigger));
+}
+
+//
+// open the capture device, ensuring exclusive access
+//
+static int gpio_ts_capture_open(struct inode *ind, struct file *filp) {
+
+    mutex_lock(&capture_lock);
+    if (capture_open) {
+        mutex_unlock(&capture_lock);
+        return -EBUSY;
+    }
+    capture_open = true;
+    mutex_unlock(&capture_lock);
+    filp->private_data = capture;
+
+    return 0;
+}
+
+//
+// close the capture device, stopping its capture session
+//
+static int gpio_ts_capture_release(struct inode *ind, struct file *filp) {
+
+    mutex_lock(&capture_lock);
+    gpio_ts_capture_disarm();
+    capture_open = false;
+    mutex_unlock(&capture_lock);
+    filp->private_data = NULL;
+
+    return 0;
+}
+
+//
+// read the completed capture in one go, which ends the capture session
+// waits for the capture to complete, unless the device was opened with O_NONBLOCK
+// the length is in bytes and must hold (pre + 1 + post) struct gpio_ts_event records
+// the number of bytes read is returned, 0 if there is no capture session
+//
+static ssize_t gpio_ts_capture_read(struct file *filp, char *buffer, size_t length, loff_t *offset) {
+
+    int nread;
+    size_t nevents;
+    ssize_t lg;
+    struct gpio_ts_event *kbuffer;
+    unsigned long irqmsk;
+
+    mutex_lock(&capture_lock);
+    while ((capture_state == GPIO_TS_CAPTURE_ARMED) || (capture_state == GPIO_TS_CAPTURE_TRIGGERED)) {
+        mutex_unlock(&capture_lock);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(capture->waitqueue,
+                                     (READ_ONCE(capture_state) == GPIO_TS_CAPTURE_DONE) ||
+                                     (READ_ONCE(capture_state) == GPIO_TS_CAPTURE_IDLE)) != 0)
+            return -ERESTARTSYS;
+        mutex_lock(&capture_lock);
+    }
+    if (capture_state == GPIO_TS_CAPTURE_IDLE) {
+        mutex_unlock(&capture_lock);
+        return 0;
+    }
+
+    nevents = capture_config.pre + 1 + capture_config.post;
+    if (length < nevents * sizeof(struct gpio_ts_event)) {
+        mutex_unlock(&capture_lock);
+        return -EINVAL;
+    }
+    kbuffer = kvmalloc_array(nevents, sizeof(struct gpio_ts_event), GFP_KERNEL);
+    if (kbuffer == NULL) {
+        mutex_unlock(&capture_lock);
+        return -ENOMEM;
+    }
+    spin_lock_irqsave(&capture_spinlock, irqmsk);
+    nread = gpio_capture_read(capture, kbuffer);
+    spin_unlock_irqrestore(&capture_spinlock, irqmsk);
+    gpio_ts_capture_disarm();
+    mutex_unlock(&capture_lock);
+
+    lg = nread * sizeof(struct gpio_ts_event);
+    if (copy_to_user(buffer, kbuffer, lg) != 0)
+        lg = -EFAULT;
+    kvfree(kbuffer);
+
+    return lg;
+}
+
+//
+// poll support for the capture device: readable when the capture is complete
+//
+static unsigned int gpio_ts_capture_poll(struct file *filp, struct poll_table_struct *polltable) {
+
+    poll_wait(filp, &capture->waitqueue, polltable);
+    if (READ_ONCE(capture_state) == GPIO_TS_CAPTURE_DONE) {
+        return POLLPRI | POLLIN;
+    }
+    return 0;
+}
+
+//
+// ioctl support for the capture device
+//
+static long gpio_ts_capture_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+
+    long err;
+
+    mutex_lock(&capture_lock);
+    switch (cmd) {
+    case GPIO_TS_IOC_CAPTURE_ARM:
+        err = gpio_ts_capture_arm((struct gpio_ts_capture __user *)arg);
+        break;
+    case GPIO_TS_IOC_CAPTURE_DISARM:
+        gpio_ts_capture_disarm();
+        err = 0;
+        break;
+    default:
+        err = -ENOTTY;
+        break;
+    }
+    mutex_unlock(&capture_lock);
+
+    return err;
+}
+
+// ------------------ IRQ handler----------- ----------------------------
+
+//
+// pulse width mode: called by the ISR (the hard IRQ part in threaded mode), or the poll timer during an interrupt storm, for both edges
+// a rising edge completes the period started by the previous rising edge
+// the durations come from stamp_ns, the CLOCK_MONOTONIC time of the edge, so a step of the wall clock can't distort them
+// returns true if the event has been turned into the record of a complete period, with the CLOCK_MONOTONIC time of its rising edge in record_ns
+// otherwise the edge is only remembered and nothing must be stored
+//
+static bool gpio_ts_pulse(struct gpio_ts_devinfo *devinfo, struct gpio_ts_event *event, int level, u64 stamp_ns, u64 *record_ns) {
+
+    s64 now = stamp_ns;
+    struct gpio_ts_event edge = *event;
+    bool complete = false;
+
+    // the level right after the edge tells which edge it was
+    if (level) {
+        if ((devinfo->pulse_rise_ns != 0) && (devinfo->pulse_fall_ns != 0)) {
+            *event = devinfo->pulse_start;
+            event->flags |= GPIO_TS_EVENT_PULSE;
+            event->high_ns = clamp_t(s64, devinfo->pulse_fall_ns - devinfo->pulse_rise_ns, 0, U32_MAX);
+            event->low_ns = clamp_t(s64, now - devinfo->pulse_fall_ns, 0, U32_MAX);
+            *record_ns = devinfo->pulse_rise_ns;
+            complete = true;
+        }
+        // a rising edge without a falling edge before it: we missed one, start over
+        devinfo->pulse_start = edge;
+        devinfo->pulse_rise_ns = now;
+        devinfo->pulse_fall_ns = 0;
+    } else if (devinfo->pulse_rise_ns != 0) {
+        devinfo->pulse_fall_ns = now;
+    }
+    return complete;
+}
+
+//
+// fill in an event for a device with the timestamp
+// and the levels of the snapshot GPIOs, so they are consistent with the timestamp
+//
+static void gpio_ts_event_init(struct gpio_ts_devinfo *devinfo, struct gpio_ts_event *event, struct timespec64 *timestamp) {
+
+    int i;
+
+    event->tv_sec = timestamp->tv_sec;
+    event->tv_nsec = timestamp->tv_nsec;
+    event->index = devinfo->index;
+    event->flags = 0;
+    event->levels = 0;
+    for (i = 0; i < gpio_ts_nb_snapshot; i++) {
+        if (gpio_get_value(gpio_ts_snapshot_table[i])) {
+            event->levels |= BIT_ULL(i);
+        }
+    }
+    event->high_ns = 0;
+    event->low_ns = 0;
+}
+
+//
+// store an event in the fifo queue for this device if it is open
+// and wake up the associated waitqueue so that poll() gets woken up if it's waiting
+// and retain it in the history of this device
+// and wake up the reader of the merged device, gpio_ts_record() already put the event in this CPU's ring
+// record_ns is the CLOCK_MONOTONIC time of the event, the key of the history
+// stamp_ns is the CLOCK_MONOTONIC time of the interrupt, to measure the delay until the FIFO insert
+// the locks are taken with interrupts off, because in threaded mode this runs in the IRQ thread
+//
+static void gpio_ts_store(struct gpio_ts_devinfo *devinfo, struct gpio_ts_event *event, u64 record_ns, u64 stamp_ns) {
+
+    int nwritten;
+    u64 delay;
+    unsigned long irqmsk;
+
+    if (READ_ONCE(devinfo->opencount) > 0) {
+        // lock the data fifo and insert the event
+        spin_lock_irqsave(&devinfo->spinlock, irqmsk);
+        nwritten = gpio_fifo_write(devinfo->fifo, event, 1);
+        delay = ktime_get_ns() - stamp_ns;
+        devinfo->store_count++;
+        devinfo->store_ns += delay;
+        if (delay > devinfo->store_max_ns)
+            devinfo->store_max_ns = delay;
+        if (devinfo->history != NULL)
+            gpio_history_add(devinfo->history, event, record_ns);
+        spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
+        if (nwritten != 1) {
+            printk_ratelimited(KERN_ERR "GPIOTS: ISR fifo overflow\n");
+        }
+        wake_up(&devinfo->waitqueue);
+    } else if (devinfo->history != NULL) {
+        spin_lock_irqsave(&devinfo->spinlock, irqmsk);
+        gpio_history_add(devinfo->history, event, record_ns);
+        spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
+    }
+    // don't touch the shared waitqueue lock unless a reader is actually sleeping
+    if (READ_ONCE(merged_open) && wq_has_sleeper(&merge->waitqueue)) {
+        wake_up(&merge->waitqueue);
+    }
+}
+
+//
+// the part of an edge that runs in hard IRQ context, in threaded mode too, or in the poll timer with interrupts off
+// in pulse width mode, turns the edges into one record per period, otherwise only the rising edges are recorded
+// and writes the record to this CPU's ring if the merged device is open:
+// the timestamps are taken in the same context, so each ring stays in timestamp order
+// returns true if there is a record to store, with its CLOCK_MONOTONIC time in record_ns
+//
+static bool gpio_ts_record(struct gpio_ts_devinfo *devinfo, const struct gpio_ts_event *edge, int level, u64 stamp_ns,
+                           struct gpio_ts_event *record, u64 *record_ns) {
+
+    *record = *edge;
+    *record_ns = stamp_ns;
+    if (devinfo->pulsewidth) {
+        // only complete periods are recorded
+        if (!gpio_ts_pulse(devinfo, record, level, stamp_ns, record_ns))
+            return false;
+    } else if (!level) {
+        // a falling edge only interrupts for the capture trigger
+        return false;
+    }
+    if (READ_ONCE(merged_open)) {
+        // no lock needed: nothing else writes to this CPU's ring while interrupts are off
+        // the key is the time of this interrupt, for a pulse record the end of the period
+        gpio_merge_write(merge, record, stamp_ns);
+    }
+    return true;
+}
+
+//
+// record an edge in the capture session, called by the ISR (the IRQ thread in threaded mode) or the poll timer while a session is armed
+// level is the level after the edge: 0 for a falling edge
+// before the trigger the edges of the target GPIOs go to the pre-trigger ring,
+// after it they are recorded until the capture is complete
+//
+static void gpio_ts_capture_edge(struct gpio_ts_devinfo *devinfo, struct gpio_ts_event *event, int level) {
+
+    struct gpio_ts_event edge = *event;
+    bool target;
+    bool done = false;
+    unsigned long irqmsk;
+
+    if (!level)
+        edge.flags |= GPIO_TS_EVENT_FALLING;
+    spin_lock_irqsave(&capture_spinlock, irqmsk);
+    target = (capture_config.targets & BIT(devinfo->index)) != 0;
+    if (capture_state == GPIO_TS_CAPTURE_ARMED) {
+        if ((devinfo->index == capture_config.trigger) &&
+            (capture_config.edge & (level ? GPIO_TS_CAPTURE_RISING : GPIO_TS_CAPTURE_FALLING))) {
+            edge.flags |= GPIO_TS_EVENT_TRIGGER;
+            done = gpio_capture_add(capture, &edge);
+            capture_state = done ? GPIO_TS_CAPTURE_DONE : GPIO_TS_CAPTURE_TRIGGERED;
+        } else if (target) {
+            gpio_capture_add_pre(capture, &edge);
+        }
+    } else if ((capture_state == GPIO_TS_CAPTURE_TRIGGERED) && target) {
+        done = gpio_capture_add(capture, &edge);
+        if (done)
+            capture_state = GPIO_TS_CAPTURE_DONE;
+    }
+    spin_unlock_irqrestore(&capture_spinlock, irqmsk);
+    if (done)
+        wake_up_interruptible(&capture->waitqueue);
+}
+
+//
+// interrupt storm detection, called by the ISR (the IRQ thread in threaded mode) for every interrupt
+// now is the CLOCK_MONOTONIC time of the interrupt
+// when there are more than storm_limit interrupts in a rate window the IRQ is masked
+// and the line is polled by the storm timer, on this CPU, until the storm is over
+// the counters are shared with the poll timer, so they're only touched under the spinlock, and not while polling:
+// in threaded mode the thread can still be processing edges from before the IRQ was masked
+//
+static void gpio_ts_storm_check(struct gpio_ts_devinfo *devinfo, s64 now) {
+
+    unsigned long irqmsk;
+
+    spin_lock_irqsave(&devinfo->spinlock, irqmsk);
+    if (devinfo->storm_polling || devinfo->storm_stop) {
+        spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
+        return;
+    }
+    if (now - devinfo->storm_window_ns >= GPIO_TS_STORM_WINDOW_NS) {
+        devinfo->storm_window_ns = now;
+        devinfo->storm_count = 0;
+    }
+    if (++devinfo->storm_count > storm_limit) {
+        disable_irq_nosync(devinfo->irq);
+        // the poll timer does pulse width mode like the hard IRQ part, which may still be running on another CPU
+        // when this is the IRQ thread: wait for it before starting the timer
+        if (use_threaded)
+            synchronize_hardirq(devinfo->irq);
+        gpio_ts_storm_account(devinfo);
+        devinfo->storm_polling = true;
+        devinfo->storms++;
+        devinfo->storm_level = gpio_get_value(devinfo->gpio);
+        devinfo->storm_count = 0;
+        devinfo->storm_samples = 0;
+        hrtimer_start(&devinfo->storm_timer, ns_to_ktime(gpio_ts_poll_us * NSEC_PER_USEC), HRTIMER_MODE_REL_PINNED);
+        printk_ratelimited(KERN_WARNING "GPIOTS: interrupt storm on gpio %d, polling every %d us\n",
+                           devinfo->gpio, gpio_ts_poll_us);
+    }
+    spin_unlock_irqrestore(&devinfo->spinlock, irqmsk);
+}
+
+//
+// the storm timer: polls the line of a device while its IRQ is masked
+// a transition is stored like the ISR would have, with the GPIO_TS_EVENT_POLLED flag
+// at the end of each rate window the IRQ is unmasked again if there were few enough transitions
+//
+static enum hrtimer_restart gpio_ts_storm_poll(struct hrtimer *timer) {
+
+    struct gpio_ts_devinfo *devinfo = container_of(timer, struct gpio_ts_devinfo, storm_timer);
+    struct timespec64 timestamp;
+    struct gpio_ts_event edge;
+    struct gpio_ts_event record;
+    unsigned long irqmsk;
+    u64 stamp_ns;
+    u64 record_ns;
+    int level;
+    bool transition;
+    bool store = false;
+    bool done;
+
+    // on PREEMPT_RT the timer runs in a thread: keep the hard IRQ parts from writing to this CPU's merged ring in between
+    local_irq_save(irqmsk);
+    ktime_get_real_ts64(&timestamp);
+    stamp_ns = ktime_get_ns();
+    level = gpio_get_value(devinfo->gpio);
+    transition = (level != devinfo->storm_level);
+    if (transition) {
+        devinfo->storm_level = level;
+        devinfo->storm_count++;
+        gpio_ts_event_init(devinfo, &edge, &timestamp);
+        edge.flags = GPIO_TS_EVENT_POLLED;
+        store = gpio_ts_record(devinfo, &edge, level, stamp_ns, &record, &record_ns);
+    }
+    local_irq_restore(irqmsk);
+    if (transition) {
+        if (READ_ONCE(capture_armed) && (level || devinfo->pulsewidth || READ_ONCE(devinfo->capture_edges)))
+            gpio_ts_capture_edge(devinfo, &edge, level);
+        if (store)
+            gpio_ts_store(devinfo, &record, record_ns, stamp_ns);
+    }
+
+    if (++devinfo->storm_samples >= storm_samples) {
+        spin_lock(&devinfo->spinlock);
+        done = devinfo->storm_stop || (devinfo->storm_count <= storm_exit_limit);
+        if (done && !devinfo->storm_stop) {
+            gpio_ts_storm_account(devinfo);
+            devinfo->storm_polling = false;
+            devinfo->storm_window_ns = 0;
+            enable_irq(devinfo->irq);
+            printk_ratelimited(KERN_INFO "GPIOTS: interrupt storm on gpio %d is over\n", devinfo->gpio);
+        }
+        devinfo->storm_count = 0;
+        devinfo->storm_samples = 0;
+        spin_unlock(&devinfo->spinlock);
+        if (done)
+            return HRTIMER_NORESTART;
+    }
+    hrtimer_forward_now(timer, ns_to_ktime(gpio_ts_poll_us * NSEC_PER_USEC));
+    return HRTIMER_RESTART;
+}
+
+#if IS_ENABLED(CONFIG_PPS)
+//
+// hand the ISR timestamps of a rising edge to the PPS subsystem as an assert event
+//
+static void gpio_ts_pps_assert(struct gpio_ts_devinfo *devinfo, struct pps_event_time *pps_ts) {
+
+    pps_event(devinfo->pps, pps_ts, PPS_CAPTUREASSERT, NULL);
+}
+#endif
+
+//
+// take the timestamp of an interrupt, first thing in the ISR
+// for a PPS source pps_get_ts() also takes the CLOCK_MONOTONIC_RAW time NTP wants, together with the CLOCK_REALTIME one
+// returns true if the edge is for the PPS source
+//
+static bool gpio_ts_timestamp(struct gpio_ts_devinfo *devinfo, struct pps_event_time *pps_ts) {
+
+#if IS_ENABLED(CONFIG_PPS)
+    if (READ_ONCE(devinfo->pps) != NULL) {
+        pps_get_ts(pps_ts);
+        return true;
+    }
+#endif
+    ktime_get_real_ts64(&pps_ts->ts_real);
+    return false;
+}
+
+//
+// process the rest of an edge, after gpio_ts_record()
+// called by the ISR, or by the IRQ thread in threaded mode
+// passes the timestamps to the PPS source of the GPIO, if pps_ts isn't NULL
+// records the edge in the capture session if one is armed
+// stores the record, if there is one
+// then counts the interrupt for the storm detection, which masks the IRQ and switches to polling if the rate is too high
+//
+static void gpio_ts_edge(struct gpio_ts_devinfo *devinfo, struct gpio_ts_event *edge, int level, u64 stamp_ns,
+                        struct pps_event_time *pps_ts, struct gpio_ts_event *record, u64 record_ns) {
+
+#if IS_ENABLED(CONFIG_PPS)
+    if ((pps_ts != NULL) && level) {
+        gpio_ts_pps_assert(devinfo, pps_ts);
+    }
+#endif
+    if (READ_ONCE(capture_armed)) {
+        gpio_ts_capture_edge(devinfo, edge, level);
+    }
+    if (record != NULL) {
+        gpio_ts_store(devinfo, record, record_ns, stamp_ns);
+    }
+    // a falling edge that only interrupts for the capture trigger doesn't count toward the rate
+    if ((storm_limit > 0) && (level || devinfo->pulsewidth)) {
+        gpio_ts_storm_check(devinfo, stamp_ns);
+    }
+}
+
+//
+// handles GPIO interrupts
+// the IRQ is only requested while the device, the merged device or a capture session is open,
+// or always for a PPS source, so somebody's always listening
+// gets the current timestamp
+// samples the levels of the snapshot GPIOs, so they are consistent with the timestamp
+// and processes the edge
+//  
+static irqreturn_t gpio_ts_handler(int irq, void *arg) {
+
+    struct pps_event_time pps_ts;
+    struct gpio_ts_event edge;
+    struct gpio_ts_event record;
+    struct gpio_ts_devinfo *devinfo = (struct gpio_ts_devinfo *)arg;
+    bool pps;
+    bool store;
+    int level;
+    u64 stamp_ns;
+    u64 record_ns;
+
+    if (module_unload) {
+        return -IRQ_NONE; // ignore if module is unloading
+    }
+
+    // first of all get the timestamp
+    pps = gpio_ts_timestamp(devinfo, &pps_ts);
+    stamp_ns = ktime_get_ns();
+
+    gpio_ts_event_init(devinfo, &edge, &pps_ts.ts_real);
+    // the level right after the edge tells which edge it was, when the IRQ triggers on both
+    level = (devinfo->pulsewidth || READ_ONCE(devinfo->capture_edges)) ? gpio_get_value(devinfo->gpio) : 1;
+    store = gpio_ts_record(devinfo, &edge, level, stamp_ns, &record, &record_ns);
+    gpio_ts_edge(devinfo, &edge, level, stamp_ns, pps ? &pps_ts : NULL, store ? &record : NULL, record_ns);
+    if (READ_ONCE(merged_open)) {
+        gpio_merge_account(merge, ktime_get_ns() - stamp_ns);
+    }
+
+    return IRQ_HANDLED;
+}
+
+//
+// threaded mode: the hard IRQ part
+// takes the timestamp and samples the levels, does pulse width mode and the merged device's ring,
+// which need the edges in order, and stages the rest for the IRQ thread
+// it takes no locks, so that it can stay in hard IRQ context on PREEMPT_RT
+// a single producer / single consumer ring: the IRQ of a device never runs concurrently with itself,
+// and it has one IRQ thread
+//
+static irqreturn_t gpio_ts_hardirq(int irq, void *arg) {
+
+    struct pps_event_time pps_ts;
+    struct gpio_ts_devinfo *devinfo = (struct gpio_ts_devinfo *)arg;
+    struct gpio_ts_event edge;
+    struct gpio_ts_event record;
+    struct gpio_ts_staged *staged;
+    unsigned int head;
+    bool pps;
+    bool store;
+    int level;
+    u64 stamp_ns;
+    u64 record_ns;
+
+    if (module_unload) {
+        return IRQ_NONE; // ignore if module is unloading
+    }
+
+    // first of all get the timestamp
+    pps = gpio_ts_timestamp(devinfo, &pps_ts);
+    stamp_ns = ktime_get_ns();
+
+    gpio_ts_event_init(devinfo, &edge, &pps_ts.ts_real);
+    level = (devinfo->pulsewidth || READ_ONCE(devinfo->capture_edges)) ? gpio_get_value(devinfo->gpio) : 1;
+    store = gpio_ts_record(devinfo, &edge, level, stamp_ns, &record, &record_ns);
+
+    head = devinfo->stage_head;
+    if (head - smp_load_acquire(&devinfo->stage_tail) >= GPIO_TS_STAGE_SIZE) {
+        // the thread is lagging behind: drop the rest of the edge, the next record stored tells
+        devinfo->stage_overflow = true;
+    } else {
+        staged = &devinfo->stage[head & (GPIO_TS_STAGE_SIZE - 1)];
+        staged->edge = edge;
+        staged->record = record;
+        staged->store = store;
+        if (store && devinfo->stage_overflow) {
+            staged->record.flags |= GPIO_TS_EVENT_OVERFLOW;
+            devinfo->stage_overflow = false;
+        }
+        staged->pps_ts = pps_ts;
+        staged->pps = pps;
+        staged->level = level;
+        staged->stamp_ns = stamp_ns;
+        staged->record_ns = record_ns;
+        // publish the event to the thread
+        smp_store_release(&devinfo->stage_head, head + 1);
+    }
+    if (READ_ONCE(merged_open)) {
+        gpio_merge_account(merge, ktime_get_ns() - stamp_ns);
+    }
+
+    return IRQ_WAKE_THREAD;
+}
+
+//
+// threaded mode: the IRQ thread
+// runs at the priority configured for the GPIO, which it applies to itself the first time
+// processes the rest of the edges staged by the hard IRQ part: FIFO insert, wakeups, captures, PPS and storm detection
+//
+static irqreturn_t gpio_ts_thread(int irq, void *arg) {
+
+    struct gpio_ts_devinfo *devinfo = (struct gpio_ts_devinfo *)arg;
+    struct gpio_ts_staged staged;
+    struct sched_attr attr;
+    unsigned int tail;
+    int err;
+
+    if (!devinfo->thread_prio_set) {
+        devinfo->thread_prio_set = true;
+        if (devinfo->thread_prio > 0) {
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.sched_policy = SCHED_FIFO;
+            attr.sched_priority = devinfo->thread_prio;
+            err = sched_setattr_nocheck(current, &attr);
+            if (err != 0) {
+                printk(KERN_ERR "GPIOTS: error %d setting the IRQ thread priority of gpio %d\n", err, devinfo->gpio);
+            }
+        }
+    }
+
+    tail = devinfo->stage_tail;
+    while (tail != smp_load_acquire(&devinfo->stage_head)) {
+        staged = devinfo->stage[tail & (GPIO_TS_STAGE_SIZE - 1)];
+        // give the slot back before the slow part
+        tail++;
+        smp_store_release(&devinfo->stage_tail, tail);
+        gpio_ts_edge(devinfo, &staged.edge, staged.level, staged.stamp_ns, staged.pps ? &staged.pps_ts : NULL,
+                     staged.store ? &staged.record : NULL, staged.record_ns);
+    }
+
+    return IRQ_HANDLED;
+}
+
+// ------------------ Driver private global data ----------------------------
+
+// splice() goes through read_iter: since 6.5 a character device has to ask for that explicitly
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define gpio_ts_splice_read copy_splice_read
+#else
+#define gpio_ts_splice_read generic_file_splice_read
+#endif
+
+static struct file_operations gpio_ts_fops = {
+    .owner = THIS_MODULE, 
+    .open = gpio_ts_open, 
+    .release = gpio_ts_release, 
+    .read = gpio_ts_read, 
+    .read_iter = gpio_ts_read_iter,
+    .splice_read = gpio_ts_splice_read,
+    .poll = gpio_ts_poll,
+    .unlocked_ioctl = gpio_ts_ioctl,
+    // the ioctl structures have the same layout for 32 bit processes
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
+};
+
+static struct file_operations gpio_ts_merged_fops = {
+    .owner = THIS_MODULE, 
+    .open = gpio_ts_merged_open, 
+    .release = gpio_ts_merged_release, 
+    .read = gpio_ts_merged_read, 
+    .read_iter = gpio_ts_merged_read_iter,
+    .splice_read = gpio_ts_splice_read,
+    .poll = gpio_ts_merged_poll,
+};
+
+static struct file_operations gpio_ts_capture_fops = {
+    .owner = THIS_MODULE, 
+    .open = gpio_ts_capture_open, 
+    .release = gpio_ts_capture_release, 
+    .read = gpio_ts_capture_read, 
+    .poll = gpio_ts_capture_poll,
+    .unlocked_ioctl = gpio_ts_capture_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
+};
+
+static dev_t gpio_ts_dev;
+static struct cdev gpio_ts_cdev;
+static struct cdev gpio_ts_merged_cdev;
+static struct cdev gpio_ts_capture_cdev;
+// number of minors: one for each GPIO, plus the merged and capture devices if requested
+static int gpio_ts_nb_minors;
+// minor number of the capture device, following the merged device
+static int gpio_ts_capture_minor;
+static struct class *gpio_ts_class = NULL;
+
+// ------------------ Driver init and exit methods --------------------------
+
+#if IS_ENABLED(CONFIG_PPS)
+//
+// register a GPIO as a kernel PPS source, that gets the timestamps of the rising edges
+// the PPS source holds a reference to the IRQ until the module is removed
+//
+static int gpio_ts_pps_register(struct gpio_ts_devinfo *devinfo) {
+
+    int err;
+    struct pps_source_info info;
+    struct pps_device *pps;
+
+    memset(&info, 0, sizeof(info));
+    snprintf(info.name, PPS_MAX_NAME_LEN, GPIO_TS_ENTRIES_NAME, devinfo->index);
+    info.mode = PPS_CAPTUREASSERT | PPS_OFFSETASSERT | PPS_CANWAIT | PPS_TSFMT_TSPEC;
+    info.owner = THIS_MODULE;
+    pps = pps_register_source(&info, PPS_CAPTUREASSERT | PPS_OFFSETASSERT);
+    if (IS_ERR_OR_NULL(pps)) {
+        printk(KERN_ERR "GPIOTS: could not register gpio %d as a PPS source\n", devinfo->gpio);
+        return -EINVAL;
+    }
+
+    mutex_lock(&devinfo->lock);
+    err = gpio_ts_irq_get(devinfo);
+    if (err == 0)
+        WRITE_ONCE(devinfo->pps, pps);
+    mutex_unlock(&devinfo->lock);
+    if (err != 0) {
+        pps_unregister_source(pps);
+        return err;
+    }
+    printk(KERN_INFO "GPIOTS: gpio %d registered as a PPS source\n", devinfo->gpio);
+
+    return 0;
+}
+
+//
+// release the IRQ reference of a PPS source and unregister it
+//
+static void gpio_ts_pps_unregister(struct gpio_ts_devinfo *devinfo) {
+
+    struct pps_device *pps = devinfo->pps;
+
+    if (pps == NULL)
+        return;
+    mutex_lock(&devinfo->lock);
+    gpio_ts_irq_put(devinfo);
+    devinfo->pps = NULL;
+    mutex_unlock(&devinfo->lock);
+    pps_unregister_source(pps);
+}
+#endif
+
+// 
+// initalize the device structures for each device
+// create the character devices
+// create the sysfs interface
+// map each GPIO to its IRQ, the ISR is only registered when the device is opened
+//
+static int __init gpio_ts_init(void) {
+
+    int err;
+    int i;
+    int gpio;
+    int irq;
+    int irqs[GPIO_TS_NB_ENTRIES_MAX];
+    struct gpio_ts_devinfo *devinfo;
+
+    // zero device table 
+    for (i = 0; i < GPIO_TS_NB_ENTRIES_MAX; ++i) {
+        devtable[i] = NULL;
+    }
+
+    // sanity checks
+    if (gpio_ts_nb_gpios < 1) {
+        printk(KERN_ERR "%s: I need at least one GPIO input\n", THIS_MODULE->name);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < gpio_ts_nb_gpios; ++i) {
+        gpio = gpio_ts_table[i];
+        if (!gpio_is_valid(gpio)) {
+            printk(KERN_ERR "GPIOTS: invalid gpio pin %d\n", gpio);
+            return -ENODEV;
+        }
+    }
+
+    if ((gpio_ts_storm_rate < 0) || (gpio_ts_poll_us < 10) || (gpio_ts_poll_us > GPIO_TS_STORM_WINDOW_NS / NSEC_PER_USEC)) {
+        printk(KERN_ERR "GPIOTS: invalid storm rate %d or poll period %d us\n", gpio_ts_storm_rate, gpio_ts_poll_us);
+        return -EINVAL;
+    }
+    if (gpio_ts_storm_rate > 0) {
+        storm_limit = max_t(int, gpio_ts_storm_rate / (NSEC_PER_SEC / GPIO_TS_STORM_WINDOW_NS), 1);
+        storm_samples = GPIO_TS_STORM_WINDOW_NS / (gpio_ts_poll_us * NSEC_PER_USEC);
+        // polling aliases a fast oscillation into transitions at about half the polls, so that keeps polling
+        storm_exit_limit = min(storm_limit / 2, storm_samples / 4);
+    }
+
+#if !IS_ENABLED(CONFIG_PPS)
+    for (i = 0; i < gpio_ts_nb_pps; ++i) {
+        if (gpio_ts_pps_table[i] != 0) {
+            printk(KERN_ERR "GPIOTS: pps requested, but the kernel has no PPS support\n");
+            return -EINVAL;
+        }
+    }
+#endif
+
+    for (i = 0; i < gpio_ts_nb_priority; ++i) {
+        if ((gpio_ts_priority_table[i] < 0) || (gpio_ts_priority_table[i] >= MAX_RT_PRIO)) {
+            printk(KERN_ERR "GPIOTS: invalid IRQ thread priority %d\n", gpio_ts_priority_table[i]);
+            return -EINVAL;
+        }
+    }
+
+    if (gpio_ts_capture_size < 0) {
+        printk(KERN_ERR "GPIOTS: invalid capture size %d\n", gpio_ts_capture_size);
+        return -EINVAL;
+    }
+
+    if (gpio_ts_history_size < 0) {
+        printk(KERN_ERR "GPIOTS: invalid history size %d\n", gpio_ts_history_size);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < gpio_ts_nb_snapshot; ++i) {
+        gpio = gpio_ts_snapshot_table[i];
+        if (!gpio_is_valid(gpio)) {
+            printk(KERN_ERR "GPIOTS: invalid snapshot gpio pin %d\n", gpio);
+            return -ENODEV;
+        }
+        // the ISR can't sleep, so it can only sample GPIOs that are memory mapped
+        if (gpio_cansleep(gpio)) {
+            printk(KERN_ERR "GPIOTS: snapshot gpio %d can't be read from an ISR\n", gpio);
+            return -EINVAL;
+        }
+    }
+
+    // map each GPIO to its IRQ before any device exists, so that failing needs no unwinding
+
+    for (i = 0; i < gpio_ts_nb_gpios; ++i) {
+        gpio = gpio_ts_table[i];
+        irq = gpio_to_irq(gpio);
+        if (irq < 0) {
+            printk(KERN_ERR "GPIOTS: gpio_to_irq returned error %d for gpio %d\n", irq, gpio);
+            return -ENODEV;
+        }
+        printk(KERN_INFO "GPIOTS: gpio %d mapped to IRQ %d\n", gpio, irq);
+        irqs[i] = irq;
+    }
+
+    // allocate the merged device rings and the capture buffer before any device exists, so that failing needs no unwinding
+
+    if (use_merged) {
+        merge = gpio_merge_create();
+        if (merge == NULL)
+            return -ENOMEM;
+    }
+    if (gpio_ts_capture_size > 0) {
+        capture = gpio_capture_create(gpio_ts_capture_size);
+        if (capture == NULL) {
+            err = -ENOMEM;
+            goto err_merge;
+        }
+    }
+
+    // create the character devices
+    // from here on a failure unwinds everything set up before it
+
+    gpio_ts_capture_minor = gpio_ts_nb_gpios + (use_merged ? 1 : 0);
+    gpio_ts_nb_minors = gpio_ts_capture_minor + ((gpio_ts_capture_size > 0) ? 1 : 0);
+    err = alloc_chrdev_region(&gpio_ts_dev, 0, gpio_ts_nb_minors, THIS_MODULE->name);
+    if (err != 0) {
+        printk(KERN_ERR "GPIOTS: error %d allocating chdev_region\n", err);
+        goto err_capture;
+    }
+    printk(KERN_INFO "GPIOTS: device region allocated, major number=%x\n", gpio_ts_dev);
+
+    gpio_ts_class = class_create(THIS_MODULE, GPIO_TS_CLASS_NAME);
+    if (IS_ERR(gpio_ts_class)) {
+        printk(KERN_ERR "GPIOTS: Could not create class %s\n", GPIO_TS_CLASS_NAME);
+        err = -EINVAL;
+        goto err_region;
+    }
+    printk(KERN_INFO "GPIOTS: device class created\n");
+
+    for (i = 0; i < gpio_ts_nb_gpios; i++) {
+        devinfo = kzalloc(sizeof(struct gpio_ts_devinfo), GFP_KERNEL);
+        if (devinfo == NULL) {
+            err = -ENOMEM;
+            goto err_devices;
+        }
+        devinfo->fifo = gpio_fifo_create(GPIO_TS_FIFO_SIZE);
+        if (gpio_ts_history_size > 0)
+            devinfo->history = gpio_history_create(gpio_ts_history_size);
+        if ((devinfo->fifo == NULL) || ((gpio_ts_history_size > 0) && (devinfo->history == NULL))) {
+            printk(KERN_ERR "GPIOTS: no memory for the fifo or the history of device %d\n", i);
+            if (devinfo->fifo != NULL)
+                gpio_fifo_destroy(devinfo->fifo);
+            gpio_history_destroy(devinfo->history);
+            kfree(devinfo);
+            err = -ENOMEM;
+            goto err_devices;
+        }
+        devinfo->opencount = 0;
+        devinfo->index = i;
+        devinfo->gpio = gpio_ts_table[i];
+        devinfo->irq = irqs[i];
+        devinfo->pulsewidth = (i < gpio_ts_nb_pulsewidth) && (gpio_ts_pulsewidth_table[i] != 0);
+        devinfo->thread_prio = (i < gpio_ts_nb_priority) ? gpio_ts_priority_table[i] : 0;
+        spin_lock_init(&devinfo->spinlock);
+        mutex_init(&devinfo->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+        hrtimer_setup(&devinfo->storm_timer, gpio_ts_storm_poll, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+#else
+        hrtimer_init(&devinfo->storm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+        devinfo->storm_timer.function = gpio_ts_storm_poll;
+#endif
+        init_waitqueue_head(&devinfo->waitqueue);
+        devtable[i] = devinfo;
+
+        device_create(gpio_ts_class, NULL, MKDEV(MAJOR(gpio_ts_dev), i), NULL, GPIO_TS_ENTRIES_NAME, i);
+        printk(KERN_INFO "GPIOTS: Device %d created\n", i);
+    }
+
+    cdev_init(&gpio_ts_cdev, &gpio_ts_fops);
+
+    err = cdev_add(&(gpio_ts_cdev), gpio_ts_dev, gpio_ts_nb_gpios);
+    if (err != 0)
+        goto err_devices;
+
+    // create the merged device, with the minor number following the GPIO devices
+
+    if (use_merged) {
+        cdev_init(&gpio_ts_merged_cdev, &gpio_ts_merged_fops);
+        err = cdev_add(&gpio_ts_merged_cdev, MKDEV(MAJOR(gpio_ts_dev), gpio_ts_nb_gpios), 1);
+        if (err != 0) {
+            printk(KERN_ERR "GPIOTS: error %d adding merged device\n", err);
+            goto err_cdev;
+        }
+        device_create(gpio_ts_class, NULL, MKDEV(MAJOR(gpio_ts_dev), gpio_ts_nb_gpios), NULL, GPIO_TS_MERGED_NAME);
+        printk(KERN_INFO "GPIOTS: Merged device created\n");
+    }
+
+    // create the capture device, with the last minor number
+
+    if (gpio_ts_capture_size > 0) {
+        cdev_init(&gpio_ts_capture_cdev, &gpio_ts_capture_fops);
+        err = cdev_add(&gpio_ts_capture_cdev, MKDEV(MAJOR(gpio_ts_dev), gpio_ts_capture_minor), 1);
+        if (err != 0) {
+            printk(KERN_ERR "GPIOTS: error %d adding capture device\n", err);
+            goto err_merged_cdev;
+        }
+        device_create(gpio_ts_class, NULL, MKDEV(MAJOR(gpio_ts_dev), gpio_ts_capture_minor), NULL, GPIO_TS_CAPTURE_NAME);
+        printk(KERN_INFO "GPIOTS: Capture device created\n");
+    }
+
+    // set up sysfs
+
+    for (i = 0; i < gpio_ts_nb_gpios; ++i) {
+        gpio = gpio_ts_table[i];
+        gpio_request(gpio, "sysfs");
+        gpio_direction_input(gpio);
+        gpio_export(gpio, false);
+        printk(KERN_INFO "GPIOTS: gpio %d exported to sysfs for input\n", gpio);
+    }
+
+    // set up the snapshot GPIOs that aren't monitored GPIOs already
+
+    for (i = 0; i < gpio_ts_nb_snapshot; ++i) {
+        gpio = gpio_ts_snapshot_table[i];
+        snapshot_requested[i] = (gpio_request(gpio, "gpiots-snapshot") == 0);
+        if (snapshot_requested[i]) {
+            gpio_direction_input(gpio);
+        }
+        printk(KERN_INFO "GPIOTS: gpio %d level is bit %d of the snapshot\n", gpio, i);
+    }
+
+#if IS_ENABLED(CONFIG_PPS)
+    // register the PPS sources last, they need the IRQ all the time
+    // nothing can fail after them, except another registration, which unregisters the ones before it and unwinds the rest
+
+    for (i = 0; (i < gpio_ts_nb_pps) && (i < gpio_ts_nb_gpios); ++i) {
+        if (gpio_ts_pps_table[i] == 0)
+            continue;
+        err = gpio_ts_pps_register(devtable[i]);
+        if (err != 0) {
+            while (--i >= 0)
+                gpio_ts_pps_unregister(devtable[i]);
+            goto err_gpios;
+        }
+    }
+#endif
+
+    return 0;
+
+#if IS_ENABLED(CONFIG_PPS)
+err_gpios:
+    for (i = 0; i < gpio_ts_nb_snapshot; i++) {
+        if (snapshot_requested[i])
+            gpio_free(gpio_ts_snapshot_table[i]);
+    }
+    for (i = 0; i < gpio_ts_nb_gpios; i++) {
+        gpio_unexport(gpio_ts_table[i]);
+        gpio_free(gpio_ts_table[i]);
+    }
+    if (gpio_ts_capture_size > 0) {
+        device_destroy(gpio_ts_class, MKDEV(MAJOR(gpio_ts_dev), gpio_ts_capture_minor));
+        cdev_del(&gpio_ts_capture_cdev);
+    }
+#endif
+err_merged_cdev:
+    if (use_merged) {
+        device_destroy(gpio_ts_class, MKDEV(MAJOR(gpio_ts_dev), gpio_ts_nb_gpios));
+        cdev_del(&gpio_ts_merged_cdev);
+    }
+err_cdev:
+    cdev_del(&gpio_ts_cdev);
+    i = gpio_ts_nb_gpios;
+err_devices:
+    // the devices before i, each with its device info
+    while (--i >= 0) {
+        device_destroy(gpio_ts_class, MKDEV(MAJOR(gpio_ts_dev), i));
+        gpio_fifo_destroy(devtable[i]->fifo);
+        gpio_history_destroy(devtable[i]->history);
+        kfree(devtable[i]);
+        devtable[i] = NULL;
+    }
+    class_destroy(gpio_ts_class);
+    gpio_ts_class = NULL;
+err_region:
+    unregister_chrdev_region(gpio_ts_dev, gpio_ts_nb_minors);
+err_capture:
+    gpio_capture_destroy(capture);
+    capture = NULL;
+err_merge:
+    gpio_merge_destroy(merge);
+    merge = NULL;
+    return err;
+}
+
+//
+// clean up the module
+// the ISRs are already gone: an open device holds a module reference, so every device is closed here,
+// except those of the PPS sources, which are released first
+// remove sysfs interface and devices
+// free the device info structures and associated fifos and histories, the merged device rings and the capture buffer
+//
+void __exit gpio_ts_exit(void) {
+    int i;
+    int gpio;
+    int irq;
+
+    module_unload = true;
+
+    // clean up sysfs 
+    for (i = 0; i < gpio_ts_nb_gpios; i++) {
+        gpio = gpio_ts_table[i];
+        irq = devtable[i]->irq;
+#if IS_ENABLED(CONFIG_PPS)
+        gpio_ts_pps_unregister(devtable[i]);
+#endif
+        gpio_unexport(gpio);
+        gpio_free(gpio);
+        printk(KERN_INFO "GPIOTS: released gpio %d, irq %d\n", gpio, irq);
+        if (devtable[i]->store_count > 0) {
+            printk(KERN_INFO "GPIOTS: gpio %d: %llu events stored, delay from the interrupt average %llu ns, max %llu ns\n",
+                   gpio, devtable[i]->store_count, div64_u64(devtable[i]->store_ns, devtable[i]->store_count),
+                   devtable[i]->store_max_ns);
+        }
+        if (gpio_ts_storm_rate > 0) {
+            printk(KERN_INFO "GPIOTS: gpio %d: %llu ms with the IRQ, %llu ms polled, %u storms\n", gpio,
+                   div_u64(devtable[i]->irq_ns, NSEC_PER_MSEC), div_u64(devtable[i]->polled_ns, NSEC_PER_MSEC),
+                   devtable[i]->storms);
+        }
+    }
+    for (i = 0; i < gpio_ts_nb_snapshot; i++) {
+        if (snapshot_requested[i])
+            gpio_free(gpio_ts_snapshot_table[i]);
     }
     // clean up char devices
     cdev_del(&gpio_ts_cdev);
+    if (use_merged) {
+        cdev_del(&gpio_ts_merged_cdev);
+        device_destroy(gpio_ts_class, MKDEV(MAJOR(gpio_ts_dev), gpio_ts_nb_gpios));
+        gpio_merge_report(merge);
+        gpio_merge_destroy(merge);
+        merge = NULL;
+    }
+    if (gpio_ts_capture_size > 0) {
+        cdev_del(&gpio_ts_capture_cdev);
+        device_destroy(gpio_ts_class, MKDEV(MAJOR(gpio_ts_dev), gpio_ts_capture_minor));
+        gpio_capture_destroy(capture);
+        capture = NULL;
+    }
 
     for (i = 0; i < gpio_ts_nb_gpios; i++)
         device_destroy(gpio_ts_class, MKDEV(MAJOR(gpio_ts_dev), i));
@@ -395,11 +1907,12 @@ void __exit gpio_ts_exit(void) {
     class_destroy(gpio_ts_class);
     gpio_ts_class = NULL;
 
-    unregister_chrdev_region(gpio_ts_dev, gpio_ts_nb_gpios);
+    unregister_chrdev_region(gpio_ts_dev, gpio_ts_nb_minors);
 
     // and finally release device info memory
     for (i = 0; i < gpio_ts_nb_gpios; i++) {
         gpio_fifo_destroy(devtable[i]->fifo);
+        gpio_history_destroy(devtable[i]->history);
         kfree(devtable[i]);
     }
 }
@@ -21,88 +21,214 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
-#include <math.h>
 
+#include "correlator.h"
 #include "fifo.h"
 
 #define LUSSEN 2
 #define NGPIOS (LUSSEN * 2)
+#define NWORKERS 2        // each lus is always handled by the same worker, so its events stay in order
+#define QUEUE_SIZE 4096   // payloads in each queue between the threads
+#define READ_BATCH 64     // timestamps read from the kernel in one read()
+#define REORDER_WINDOW_NS 20000000LL   // how late a timestamp may reach a worker (20 ms)
+#define MIN_TRAVEL_NS 1000LL           // faster than 900000 km/h is a glitch
+#define MAX_TRAVEL_NS 2000000000LL     // slower than 0.45 km/h is a lost end event
 
-int main(int argc, char **argv) {
+//
+// The work is split over three stages, so that a slow terminal or disk never stalls draining the kernel FIFOs:
+//   reader:  polls the gpiots devices and hands each timestamp to the worker of its lus, it never waits for anyone
+//   workers: pair the start and end timestamps of a lus with a correlator and compute the speed,
+//            timestamps of different GPIOs may reach them out of order
+//   output:  prints the results
+//
 
-    struct timespec64 ts;
-    fifo_payload_t lus[LUSSEN];
-    for (int i = 0; i < LUSSEN; ++i) {
-        lus[i].lusid = i;
-        lus[i].ts_start = lus[i].ts_end = (struct timespec64) { 0, 0 }; 
-    }
-    int files[NGPIOS];
-    for (int i = 0; i < NGPIOS; ++i) {
-        char gpio[64];
-        snprintf(gpio, 64, "/dev/gpiots%d", i);
-        int fd = open(gpio, O_RDONLY); 
-        if (fd < 0) {
-            printf("%s open error %d\n", gpio, fd);
-            exit(-1);
-        }
-        files[i] = fd;
-    }
-    int n;
+static fifo_t *work_queues[NWORKERS];
+static fifo_t *output_queue;
+static int files[NGPIOS];
+static volatile sig_atomic_t running = 1;
+static atomic_ulong dropped;
+
+static void stop(int sig) {
+    running = 0;
+}
+
+static void *reader_thread(void *arg) {
+
+    struct timespec64 ts[READ_BATCH];
     struct pollfd fds[NGPIOS];
     for (int i = 0; i < NGPIOS; ++i) {
         fds[i].fd = files[i];
         fds[i].events = POLLPRI | POLLERR;
     }
-    while (true) {
+    while (running) {
         int rc = poll(fds, NGPIOS, 2000);
         if (rc < 0) { // error
+            if (errno == EINTR) {
+                continue;
+            }
             perror("poll failed");
-            return -1;
+            break;
         }
         if (rc == 0) { // timeout
-            //printf("poll timeout\n");
             continue;
         }
         for (int i = 0; i < NGPIOS; ++i) {
-            if (fds[i].revents != 0) {
-                n = read(files[i], &ts, 1);
-                if (n == 1) {
-                    //printf("%d  %ld %ld\n", i, ts[i].tv_sec, ts[i].tv_nsec);
-                } else {
-                    printf("**************read failed for fd%d\n", i);
-                    continue;
-                }
-                int tsi = i / 2;
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            int n = read(files[i], ts, READ_BATCH);
+            if (n < 0) {
+                printf("**************read failed for fd%d\n", i);
+                continue;
+            }
+            for (int j = 0; j < n; ++j) {
+                fifo_payload_t p = { .lusid = i / 2 };
                 if ((i & 1) == 0) {
-                    lus[tsi].ts_start = ts;
+                    p.ts_start = ts[j];
                 } else {
-                    lus[tsi].ts_end = ts;
+                    p.ts_end = ts[j];
                 }
-           } 
-        }
-        for (int i = 0 ; i < LUSSEN; ++i) {
-            if (lus[i].ts_end.tv_sec > 0) {
-                long usecs_start = lus[i].ts_start.tv_sec * 1000000 + (lus[i].ts_start.tv_nsec / 1000);
-                long usecs_end = lus[i].ts_end.tv_sec * 1000000 + (lus[i].ts_end.tv_nsec / 1000);
-                long micros = usecs_end - usecs_start;
-                if (micros > 0) {
-                    double kmph = (0.00025 * 3600 * 1000 * 1000) / (double)micros;
-                    printf("lus: %d, diff: %ld, kmph: %1.0f\n", lus[i].lusid, micros, round(kmph));    
-                } else {
-                    printf("lus %d: ***interrupts arrived out of order\n", lus[i].lusid);               
+                if (fifo_write(work_queues[p.lusid % NWORKERS], &p, 1) != 1) {
+                    atomic_fetch_add(&dropped, 1);
                 }
-                lus[i].ts_start = lus[i].ts_end = (struct timespec64){ 0, 0 };
             }
-           
         }
     }
+    for (int w = 0; w < NWORKERS; ++w) {
+        fifo_close(work_queues[w]);
+    }
+    return NULL;
+}
+
+// called by the correlator for each pair, or for an unmatched start or end
+static void speed(void *ctx, const fifo_payload_t *result) {
+
+    fifo_payload_t r = *result;
+    if ((r.ts_start.tv_sec > 0) && (r.ts_end.tv_sec > 0)) {
+        long usecs_start = r.ts_start.tv_sec * 1000000 + (r.ts_start.tv_nsec / 1000);
+        long usecs_end = r.ts_end.tv_sec * 1000000 + (r.ts_end.tv_nsec / 1000);
+        r.micros = usecs_end - usecs_start;
+        if (r.micros > 0) {
+            r.kmph = (0.00025 * 3600 * 1000 * 1000) / (double)r.micros;
+        }
+    }
+    if (fifo_write(output_queue, &r, 1) != 1) {
+        atomic_fetch_add(&dropped, 1);
+    }
+}
+
+static void *worker_thread(void *arg) {
+
+    fifo_t *queue = arg;
+    fifo_payload_t events[READ_BATCH];
+    correlator_config_t cfg = {
+        .nlanes = LUSSEN,
+        .depth = 64,
+        .window_ns = REORDER_WINDOW_NS,
+        .min_travel_ns = MIN_TRAVEL_NS,
+        .max_travel_ns = MAX_TRAVEL_NS,
+    };
+    correlator_t *correlator = correlator_create(&cfg, speed, NULL);
+    if (correlator == NULL) {
+        exit(-1);
+    }
+    while (true) {
+        int n = fifo_read_wait(queue, events, READ_BATCH, 100);
+        if ((n == 0) && fifo_closed(queue) && !fifo_data_available(queue)) {
+            break;
+        }
+        for (int j = 0; j < n; ++j) {
+            bool is_end = (events[j].ts_end.tv_sec != 0);
+            correlator_add(correlator, events[j].lusid, is_end, is_end ? &events[j].ts_end : &events[j].ts_start);
+        }
+        // let the clock match or expire what's waiting, also when no more events arrive
+        struct timespec now;
+        clock_gettime(RT_CLOCK, &now);
+        correlator_advance(correlator, &(struct timespec64){ now.tv_sec, now.tv_nsec });
+    }
+    correlator_flush(correlator);
+    correlator_destroy(correlator);
+    return NULL;
+}
+
+static void *output_thread(void *arg) {
+
+    fifo_payload_t results[READ_BATCH];
+    while (true) {
+        int n = fifo_read_wait(output_queue, results, READ_BATCH, -1);
+        if (n == 0) {
+            if (fifo_closed(output_queue) && !fifo_data_available(output_queue)) {
+                break;
+            }
+            continue;
+        }
+        for (int j = 0; j < n; ++j) {
+            if ((results[j].ts_start.tv_sec > 0) && (results[j].ts_end.tv_sec > 0)) {
+                printf("lus: %d, diff: %ld, kmph: %1.0f\n", results[j].lusid, results[j].micros, round(results[j].kmph));    
+            } else if (results[j].ts_end.tv_sec == 0) {
+                printf("lus %d: ***start without end\n", results[j].lusid);               
+            } else {
+                printf("lus %d: ***end without start\n", results[j].lusid);               
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+
+    for (int i = 0; i < NGPIOS; ++i) {
+        char gpio[64];
+        snprintf(gpio, 64, "/dev/gpiots%d", i);
+        int fd = open(gpio, O_RDONLY); 
+        if (fd < 0) {
+            printf("%s open error %d\n", gpio, fd);
+            exit(-1);
+        }
+        files[i] = fd;
+    }
+    for (int w = 0; w < NWORKERS; ++w) {
+        work_queues[w] = fifo_create(QUEUE_SIZE);
+    }
+    output_queue = fifo_create(QUEUE_SIZE);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    pthread_t reader, workers[NWORKERS], output;
+    pthread_create(&output, NULL, output_thread, NULL);
+    for (int w = 0; w < NWORKERS; ++w) {
+        pthread_create(&workers[w], NULL, worker_thread, work_queues[w]);
+    }
+    pthread_create(&reader, NULL, reader_thread, NULL);
+
+    // shut down in pipeline order, so every stage drains what it was handed
+    pthread_join(reader, NULL);
+    for (int w = 0; w < NWORKERS; ++w) {
+        pthread_join(workers[w], NULL);
+    }
+    fifo_close(output_queue);
+    pthread_join(output, NULL);
+    if (atomic_load(&dropped) > 0) {
+        printf("%lu timestamps dropped on full queues\n", atomic_load(&dropped));
+    }
+
+    for (int w = 0; w < NWORKERS; ++w) {
+        fifo_destroy(work_queues[w]);
+    }
+    fifo_destroy(output_queue);
     for (int i = 0; i < NGPIOS; ++i) {
         close(files[i]);
     }
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""
+Compare reading timestamps one os.read() at a time with batch reads by the gpiots extension.
+
+    python3 bench.py /dev/gpiots0      # a device loaded with safemode=1, while interrupts arrive
+    python3 bench.py --synthetic 1000000
+
+With --synthetic a temporary file with the given number of timespec64 records is read instead of a
+device, which measures the per-record overhead of both approaches without needing the hardware.
+
+A device returns nothing when its fifo is empty, so on a device both loops poll() for the next
+timestamps until --count records have arrived, or until no interrupt came for a second. The
+result is then bounded by the interrupt rate: use a source faster than what is being measured.
+"""
+
+import argparse
+import os
+import select
+import struct
+import tempfile
+import time
+
+import numpy as np
+
+import gpiots
+
+RECORD = struct.Struct("qq")
+IDLE_TIMEOUT_MS = 1000
+
+
+def wait_readable(fd, device):
+    """Wait for the next timestamps on a device, False when the input is over."""
+    if not device:
+        return False  # an empty read from a file is its end
+    p = select.poll()
+    p.register(fd, select.POLLIN)
+    return bool(p.poll(IDLE_TIMEOUT_MS))
+
+
+def bench_os_read(path, count, device):
+    fd = os.open(path, os.O_RDONLY)
+    n = 0
+    t0 = time.perf_counter()
+    while n < count:
+        data = os.read(fd, RECORD.size)
+        if not data:
+            if wait_readable(fd, device):
+                continue
+            break
+        sec, nsec = RECORD.unpack(data)
+        n += 1
+    t1 = time.perf_counter()
+    os.close(fd)
+    return n, t1 - t0
+
+
+def bench_batch(path, count, batch, device):
+    buf = np.empty(batch, dtype=[("tv_sec", "<i8"), ("tv_nsec", "<i8")])
+    n = 0
+    t0 = time.perf_counter()
+    with gpiots.Device(path, safemode=True) as dev:
+        while n < count:
+            got = dev.readinto(buf[:min(batch, count - n)])
+            if got == 0:
+                if wait_readable(dev.fileno(), device):
+                    continue
+                break
+            n += got
+    t1 = time.perf_counter()
+    return n, t1 - t0
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("path", nargs="?")
+    parser.add_argument("--synthetic", type=int, metavar="N")
+    parser.add_argument("--count", type=int, default=1000000)
+    parser.add_argument("--batch", type=int, default=4096)
+    args = parser.parse_args()
+
+    if args.synthetic:
+        tmp = tempfile.NamedTemporaryFile(delete=False)
+        ts = np.zeros(args.synthetic, dtype=[("tv_sec", "<i8"), ("tv_nsec", "<i8")])
+        ts["tv_sec"] = 1700000000
+        ts["tv_nsec"] = np.arange(args.synthetic) % 1000000000
+        tmp.write(ts.tobytes())
+        tmp.close()
+        path = tmp.name
+        count = args.synthetic
+    elif args.path:
+        path = args.path
+        count = args.count
+    else:
+        parser.error("give a device path or --synthetic N")
+
+    try:
+        device = not args.synthetic
+        for name, fn in (("os.read loop", lambda: bench_os_read(path, count, device)),
+                         ("gpiots batch", lambda: bench_batch(path, count, args.batch, device))):
+            n, secs = fn()
+            print("%-14s %9d records in %.3f s: %12.0f records/s" % (name, n, secs, n / secs if secs > 0 else 0))
+    finally:
+        if args.synthetic:
+            os.unlink(path)
+
+
+if __name__ == "__main__":
+    main()
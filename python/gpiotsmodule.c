@@ -0,0 +1,346 @@
+/*
+Licensed under The MIT License (MIT)
+
+Copyright (c) 2018 Danny Heijl
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//
+// CPython extension for reading gpiots devices in large batches.
+//
+// Device.read() drains a device into one buffer with as few read() calls as possible and returns it
+// as a Batch, that exposes the records through the buffer protocol: numpy.asarray(batch) is a structured
+// array (tv_sec, tv_nsec, ...) on the same memory, so no Python object is created per timestamp.
+// Device.readinto() drains directly into any writable buffer, like a preallocated numpy array.
+//
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../gpiots_event.h"
+
+typedef int64_t time64_t;
+struct timespec64 {
+    time64_t tv_sec; /* seconds */
+    long tv_nsec;    /* nanoseconds */
+};
+
+#define DEFAULT_BATCH 4096
+
+// PEP 3118 formats of the two record types, numpy turns these into structured dtypes
+#if LONG_MAX == INT64_MAX
+#define TIMESPEC_FORMAT "T{q:tv_sec:q:tv_nsec:}"
+#else
+#define TIMESPEC_FORMAT "T{q:tv_sec:l:tv_nsec:}"
+#endif
+#define EVENT_FORMAT "T{q:tv_sec:q:tv_nsec:I:index:I:flags:Q:levels:I:high_ns:I:low_ns:}"
+
+// ------------------ Batch ------------------------------------------------
+
+typedef struct {
+    PyObject_HEAD
+    char *data;
+    Py_ssize_t nrecords;
+    Py_ssize_t recsize;
+    const char *format;
+    Py_ssize_t shape[1];
+    Py_ssize_t strides[1];
+} BatchObject;
+
+static void Batch_dealloc(BatchObject *self) {
+    free(self->data);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+// the records are read-only: PyBuffer_FillInfo() raises BufferError when a writable view is requested
+static int Batch_getbuffer(BatchObject *self, Py_buffer *view, int flags) {
+    if (PyBuffer_FillInfo(view, (PyObject *)self, self->data, self->nrecords * self->recsize, 1, flags) < 0) {
+        return -1;
+    }
+    self->shape[0] = self->nrecords;
+    self->strides[0] = self->recsize;
+    view->itemsize = self->recsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char *)self->format : NULL;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) ? self->strides : NULL;
+    return 0;
+}
+
+static Py_ssize_t Batch_length(BatchObject *self) {
+    return self->nrecords;
+}
+
+static PyBufferProcs Batch_as_buffer = {
+    .bf_getbuffer = (getbufferproc)Batch_getbuffer,
+};
+
+static PySequenceMethods Batch_as_sequence = {
+    .sq_length = (lenfunc)Batch_length,
+};
+
+static PyTypeObject BatchType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gpiots.Batch",
+    .tp_doc = "A batch of records read from a gpiots device, use numpy.asarray() to view them",
+    .tp_basicsize = sizeof(BatchObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)Batch_dealloc,
+    .tp_as_buffer = &Batch_as_buffer,
+    .tp_as_sequence = &Batch_as_sequence,
+};
+
+// ------------------ Device -----------------------------------------------
+
+typedef struct {
+    PyObject_HEAD
+    int fd;
+    int records;   // the device returns struct gpio_ts_event records
+    int safemode;  // the device was loaded with safemode=1
+    Py_ssize_t recsize;
+} DeviceObject;
+
+// the fd is -1 until __init__ opens the device, so that a failed __init__ closes nothing
+static PyObject *Device_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    DeviceObject *self = (DeviceObject *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->fd = -1;
+    }
+    return (PyObject *)self;
+}
+
+static int Device_init(DeviceObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = { "path", "records", "safemode", NULL };
+    const char *path;
+    self->records = 0;
+    self->safemode = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|pp", kwlist, &path, &self->records, &self->safemode)) {
+        return -1;
+    }
+    self->recsize = self->records ? sizeof(struct gpio_ts_event) : sizeof(struct timespec64);
+    // __init__ called again on an open device: don't leak the previous fd
+    if (self->fd >= 0) {
+        close(self->fd);
+        self->fd = -1;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    self->fd = open(path, O_RDONLY);
+    Py_END_ALLOW_THREADS
+    if (self->fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return -1;
+    }
+    return 0;
+}
+
+static void Device_dealloc(DeviceObject *self) {
+    if (self->fd >= 0) {
+        close(self->fd);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+// read up to max records into buf, calling read() until the device is drained or buf is full
+// returns the number of records read, or -1 with errno set
+static Py_ssize_t drain(DeviceObject *self, char *buf, Py_ssize_t max) {
+    Py_ssize_t n = 0;
+    while (n < max) {
+        char *p = buf + n * self->recsize;
+        Py_ssize_t want = max - n;
+        ssize_t rc;
+        if (self->records || self->safemode) {
+            // the length is in bytes, and so is the result
+            rc = read(self->fd, p, want * self->recsize);
+            if (rc > 0) {
+                rc /= self->recsize;
+            }
+        } else {
+            // the length is a number of timestamps, and so is the result
+            rc = read(self->fd, p, want);
+        }
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break; // drained, keep what was read so far
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            break; // drained
+        }
+        n += rc;
+    }
+    return n;
+}
+
+static PyObject *Device_read(DeviceObject *self, PyObject *args) {
+    Py_ssize_t max = DEFAULT_BATCH;
+    if (!PyArg_ParseTuple(args, "|n", &max)) {
+        return NULL;
+    }
+    if (self->fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "device is closed");
+        return NULL;
+    }
+    if (max < 0) {
+        PyErr_SetString(PyExc_ValueError, "max must be positive");
+        return NULL;
+    }
+    BatchObject *batch = PyObject_New(BatchObject, &BatchType);
+    if (batch == NULL) {
+        return NULL;
+    }
+    batch->recsize = self->recsize;
+    batch->format = self->records ? EVENT_FORMAT : TIMESPEC_FORMAT;
+    batch->nrecords = 0;
+    batch->data = malloc(max > 0 ? max * self->recsize : 1);
+    if (batch->data == NULL) {
+        Py_DECREF(batch);
+        return PyErr_NoMemory();
+    }
+    Py_ssize_t n;
+    Py_BEGIN_ALLOW_THREADS
+    n = drain(self, batch->data, max);
+    Py_END_ALLOW_THREADS
+    if (n < 0) {
+        Py_DECREF(batch);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    batch->nrecords = n;
+    return (PyObject *)batch;
+}
+
+static PyObject *Device_readinto(DeviceObject *self, PyObject *args) {
+    Py_buffer view;
+    if (!PyArg_ParseTuple(args, "w*", &view)) {
+        return NULL;
+    }
+    if (self->fd < 0) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "device is closed");
+        return NULL;
+    }
+    Py_ssize_t n;
+    Py_BEGIN_ALLOW_THREADS
+    n = drain(self, view.buf, view.len / self->recsize);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    if (n < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return PyLong_FromSsize_t(n);
+}
+
+static PyObject *Device_fileno(DeviceObject *self, PyObject *unused) {
+    return PyLong_FromLong(self->fd);
+}
+
+static PyObject *Device_close(DeviceObject *self, PyObject *unused) {
+    if (self->fd >= 0) {
+        close(self->fd);
+        self->fd = -1;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *Device_enter(DeviceObject *self, PyObject *unused) {
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *Device_exit(DeviceObject *self, PyObject *args) {
+    return Device_close(self, NULL);
+}
+
+static PyObject *Device_get_format(DeviceObject *self, void *closure) {
+    return PyUnicode_FromString(self->records ? EVENT_FORMAT : TIMESPEC_FORMAT);
+}
+
+static PyObject *Device_get_recsize(DeviceObject *self, void *closure) {
+    return PyLong_FromSsize_t(self->recsize);
+}
+
+static PyMethodDef Device_methods[] = {
+    { "read", (PyCFunction)Device_read, METH_VARARGS, "read([max]) -> Batch: drain up to max records" },
+    { "readinto", (PyCFunction)Device_readinto, METH_VARARGS, "readinto(buffer) -> int: drain records into a writable buffer" },
+    { "fileno", (PyCFunction)Device_fileno, METH_NOARGS, "the file descriptor, for select/poll" },
+    { "close", (PyCFunction)Device_close, METH_NOARGS, "close the device" },
+    { "__enter__", (PyCFunction)Device_enter, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction)Device_exit, METH_VARARGS, NULL },
+    { NULL }
+};
+
+static PyGetSetDef Device_getset[] = {
+    { "format", (getter)Device_get_format, NULL, "PEP 3118 format of a record", NULL },
+    { "recsize", (getter)Device_get_recsize, NULL, "size of a record in bytes", NULL },
+    { NULL }
+};
+
+static PyTypeObject DeviceType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gpiots.Device",
+    .tp_doc = "Device(path, records=False, safemode=True): a gpiots device\n\n"
+              "records: the device returns struct gpio_ts_event records (records=1, pulse width mode or the merged device)\n"
+              "safemode: the module was loaded with safemode=1 (ignored for records)",
+    .tp_basicsize = sizeof(DeviceObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = Device_new,
+    .tp_init = (initproc)Device_init,
+    .tp_dealloc = (destructor)Device_dealloc,
+    .tp_methods = Device_methods,
+    .tp_getset = Device_getset,
+};
+
+// ------------------ Module -----------------------------------------------
+
+static struct PyModuleDef gpiots_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "gpiots",
+    .m_doc = "Batch reads of gpiots GPIO interrupt timestamps",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_gpiots(void) {
+    if ((PyType_Ready(&BatchType) < 0) || (PyType_Ready(&DeviceType) < 0)) {
+        return NULL;
+    }
+    PyObject *m = PyModule_Create(&gpiots_module);
+    if (m == NULL) {
+        return NULL;
+    }
+    Py_INCREF(&DeviceType);
+    PyModule_AddObject(m, "Device", (PyObject *)&DeviceType);
+    Py_INCREF(&BatchType);
+    PyModule_AddObject(m, "Batch", (PyObject *)&BatchType);
+    PyModule_AddIntConstant(m, "EVENT_OVERFLOW", GPIO_TS_EVENT_OVERFLOW);
+    PyModule_AddIntConstant(m, "EVENT_PULSE", GPIO_TS_EVENT_PULSE);
+    PyModule_AddIntConstant(m, "EVENT_POLLED", GPIO_TS_EVENT_POLLED);
+    PyModule_AddIntConstant(m, "EVENT_TRIGGER", GPIO_TS_EVENT_TRIGGER);
+    PyModule_AddIntConstant(m, "EVENT_FALLING", GPIO_TS_EVENT_FALLING);
+    return m;
+}
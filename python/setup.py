@@ -0,0 +1,8 @@
+from setuptools import setup, Extension
+
+setup(
+    name="gpiots",
+    version="1.0",
+    description="Batch reads of gpiots GPIO interrupt timestamps",
+    ext_modules=[Extension("gpiots", sources=["gpiotsmodule.c"], extra_compile_args=["-std=gnu11"])],
+)